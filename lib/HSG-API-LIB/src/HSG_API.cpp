@@ -142,6 +142,11 @@ void _setMqtt(JsonVariant json)
   {
     _apiMqtt->setTopicSuffix(NULL);
   }
+
+  // Protocol level (4 = 3.1.1, 5 = MQTT 5), persistent sessions and MQTT 5 session expiry
+  _apiMqtt->setProtocolVersion(json["protocolVersion"] | MQTT_VERSION_3_1_1);
+  _apiMqtt->setPersistentSession(json["persistentSession"] | true);
+  _apiMqtt->setSessionExpiry(json["sessionExpirySeconds"] | MQTT_DEFAULT_SESSION_EXPIRY);
 }
 
 void _setConfig(JsonVariant json)
@@ -172,7 +177,7 @@ void _apiCors(Request &req, Response &res)
 /* API endpoint handlers */
 void _getApiAdopt(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(1024);
 
   if (_apiAdopt)
   { 
@@ -185,7 +190,7 @@ void _getApiAdopt(Request &req, Response &res)
 
 void _getApiMqtt(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(1024);
 
   if (!_readJson(&json, MQTT_FILENAME))
   {
@@ -223,7 +228,7 @@ void _getApiMqtt(Request &req, Response &res)
 
 void _postApiMqtt(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(1024);
 
   DeserializationError error = deserializeJson(json, req);
   if (error) 
@@ -246,7 +251,7 @@ void _postApiMqtt(Request &req, Response &res)
 
 void _getApiConfig(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(API_CONFIG_DOC_SIZE);
 
   if (!_readJson(&json, CONFIG_FILENAME))
   {
@@ -260,7 +265,7 @@ void _getApiConfig(Request &req, Response &res)
 
 void _postApiConfig(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(API_CONFIG_DOC_SIZE);
 
   DeserializationError error = deserializeJson(json, req);
   if (error) 
@@ -281,7 +286,7 @@ void _postApiConfig(Request &req, Response &res)
 
 void _postApiCommand(Request &req, Response &res)
 {
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_API> json(1024);
 
   DeserializationError error = deserializeJson(json, req);
   if (error) 
@@ -382,14 +387,14 @@ void HSG_API::begin()
     _mountFS();
   }
 
-  DynamicJsonDocument mqtt(1024);
+  TrackedJsonDocument<HEAP_TAG_CONFIG> mqtt(1024);
 
   if (_readJson(&mqtt, MQTT_FILENAME))
   {
     _setMqtt(mqtt.as<JsonVariant>());
   }
 
-  DynamicJsonDocument config(1024);
+  TrackedJsonDocument<HEAP_TAG_CONFIG> config(API_CONFIG_DOC_SIZE);
 
   if (_readJson(&config, CONFIG_FILENAME))
   {
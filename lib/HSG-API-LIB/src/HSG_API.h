@@ -6,6 +6,7 @@
 #define HSG_API_H
 
 #include <HSG_MQTT.h>
+#include <HSG_HEAP.h>
 #include <ArduinoJson.h>
 #include <aWOT.h>
 #include <Client.h>
@@ -23,6 +24,9 @@
 // JSON Schema Version
 #define JSON_SCHEMA_VERSION   "http://json-schema.org/draft-07/schema#"
 
+// Persisted config documents, large enough for the firmware's whole config (rules, scenes, etc)
+#define API_CONFIG_DOC_SIZE   16384
+
 class HSG_API
 {
   public:
@@ -0,0 +1,192 @@
+/*
+ * HSG_HEAP.cpp
+ */
+
+#include "HSG_HEAP.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(ARDUINO)
+#include <Arduino.h>
+#endif
+
+// Prepended to every tracked block so we know its size and owner on free,
+// padded to 8 bytes to preserve the alignment malloc gives us
+struct HeapHeader
+{
+  uint32_t size;
+  uint8_t  tag;
+  uint8_t  padding[3];
+};
+
+static const char * HEAP_TAG_NAMES[HEAP_TAG_COUNT] =
+{
+  "config", "command", "status", "telemetry", "adopt", "mqtt", "api"
+};
+
+static HeapTagStats _stats[HEAP_TAG_COUNT];
+
+static void _track(uint8_t tag, uint32_t size)
+{
+  HeapTagStats * stats = &_stats[tag];
+  stats->allocCount++;
+  stats->liveBytes += size;
+  if (stats->liveBytes > stats->peakBytes)
+  {
+    stats->peakBytes = stats->liveBytes;
+  }
+}
+
+static void _untrack(uint8_t tag, uint32_t size)
+{
+  HeapTagStats * stats = &_stats[tag];
+  stats->freeCount++;
+  stats->liveBytes -= size;
+}
+
+void * HSG_HEAP::allocate(uint8_t tag, size_t size)
+{
+  if (tag >= HEAP_TAG_COUNT) { return NULL; }
+
+  HeapHeader * header = (HeapHeader *)malloc(sizeof(HeapHeader) + size);
+  if (!header) { return NULL; }
+
+  header->size = size;
+  header->tag = tag;
+  _track(tag, size);
+
+  return header + 1;
+}
+
+void * HSG_HEAP::reallocate(void * ptr, size_t size)
+{
+  if (!ptr) { return NULL; }
+
+  HeapHeader * header = (HeapHeader *)ptr - 1;
+  uint8_t tag = header->tag;
+  uint32_t oldSize = header->size;
+
+  HeapHeader * resized = (HeapHeader *)realloc(header, sizeof(HeapHeader) + size);
+  if (!resized) { return NULL; }
+
+  // Count a resize as a free of the old block and an allocation of the new
+  _untrack(tag, oldSize);
+  resized->size = size;
+  _track(tag, size);
+
+  return resized + 1;
+}
+
+void HSG_HEAP::deallocate(void * ptr)
+{
+  if (!ptr) { return; }
+
+  HeapHeader * header = (HeapHeader *)ptr - 1;
+  _untrack(header->tag, header->size);
+  free(header);
+}
+
+const HeapTagStats * HSG_HEAP::getStats(uint8_t tag)
+{
+  if (tag >= HEAP_TAG_COUNT) { return NULL; }
+  return &_stats[tag];
+}
+
+const char * HSG_HEAP::getTagName(uint8_t tag)
+{
+  if (tag >= HEAP_TAG_COUNT) { return NULL; }
+  return HEAP_TAG_NAMES[tag];
+}
+
+uint32_t HSG_HEAP::getAllocCount(void)
+{
+  uint32_t count = 0;
+  for (uint8_t tag = 0; tag < HEAP_TAG_COUNT; tag++)
+  {
+    count += _stats[tag].allocCount;
+  }
+  return count;
+}
+
+uint32_t HSG_HEAP::getLiveBytes(void)
+{
+  uint32_t bytes = 0;
+  for (uint8_t tag = 0; tag < HEAP_TAG_COUNT; tag++)
+  {
+    bytes += _stats[tag].liveBytes;
+  }
+  return bytes;
+}
+
+void HSG_HEAP::reset(void)
+{
+  // Keep live bytes so outstanding blocks still balance when freed
+  for (uint8_t tag = 0; tag < HEAP_TAG_COUNT; tag++)
+  {
+    _stats[tag].allocCount = 0;
+    _stats[tag].freeCount = 0;
+    _stats[tag].peakBytes = _stats[tag].liveBytes;
+  }
+}
+
+void HSG_HEAP::setConfigSchema(JsonVariant json)
+{
+  JsonObject updateSeconds = json.createNestedObject("heapUpdateSeconds");
+  updateSeconds["title"] = "Heap Telemetry Interval (seconds)";
+  updateSeconds["description"] = "How often to report heap usage, fragmentation and per call-site allocation counts (defaults to 300 seconds, setting to 0 disables heap reports). Must be a number between 0 and 86400 (i.e. 1 day).";
+  updateSeconds["type"] = "integer";
+  updateSeconds["minimum"] = 0;
+  updateSeconds["maximum"] = 86400;
+}
+
+void HSG_HEAP::conf(JsonVariant json)
+{
+  if (json.containsKey("heapUpdateSeconds"))
+  {
+    _updateMs = json["heapUpdateSeconds"].as<uint32_t>() * 1000L;
+  }
+}
+
+void HSG_HEAP::tele(JsonVariant json)
+{
+#if defined(ARDUINO)
+  // Ignore if heap reporting has been disabled
+  if (_updateMs == 0) { return; }
+
+  // Check if we are ready to publish
+  if ((millis() - _lastUpdate) <= _updateMs) { return; }
+
+  JsonObject heap = json["heap"].to<JsonObject>();
+
+  uint32_t freeBytes = ESP.getFreeHeap();
+  uint32_t maxAllocBytes = ESP.getMaxAllocHeap();
+
+  heap["freeBytes"] = freeBytes;
+  heap["minFreeBytes"] = ESP.getMinFreeHeap();
+  heap["maxAllocBytes"] = maxAllocBytes;
+
+  // Fragmentation is how far the largest free block falls short of the total free
+  heap["fragmentation"] = freeBytes ? 100 - (uint32_t)(((uint64_t)maxAllocBytes * 100) / freeBytes) : 0;
+
+#if defined(ESP32)
+  // Low-water mark of the loop task stack (in bytes on ESP32)
+  heap["loopStackMinFreeBytes"] = uxTaskGetStackHighWaterMark(NULL);
+#endif
+
+  JsonObject tags = heap["tags"].to<JsonObject>();
+  for (uint8_t tag = 0; tag < HEAP_TAG_COUNT; tag++)
+  {
+    if (_stats[tag].allocCount == 0) { continue; }
+
+    JsonObject stats = tags[HEAP_TAG_NAMES[tag]].to<JsonObject>();
+    stats["allocs"] = _stats[tag].allocCount;
+    stats["frees"] = _stats[tag].freeCount;
+    stats["liveBytes"] = _stats[tag].liveBytes;
+    stats["peakBytes"] = _stats[tag].peakBytes;
+  }
+
+  // Reset our timer
+  _lastUpdate = millis();
+#endif
+}
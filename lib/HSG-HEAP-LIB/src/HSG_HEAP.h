@@ -0,0 +1,73 @@
+/*
+ * HSG_HEAP.h
+ *
+ * Tracks heap allocations per call-site tag so long-running fragmentation
+ * can be traced back to the code path responsible. The tracking core has
+ * no Arduino dependencies and can be linked into host tests.
+ */
+
+#ifndef HSG_HEAP_H
+#define HSG_HEAP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <ArduinoJson.h>
+
+#define DEFAULT_HEAP_UPDATE_MS    300000
+
+// Call-site tags
+#define HEAP_TAG_CONFIG           0
+#define HEAP_TAG_COMMAND          1
+#define HEAP_TAG_STATUS           2
+#define HEAP_TAG_TELEMETRY        3
+#define HEAP_TAG_ADOPT            4
+#define HEAP_TAG_MQTT             5
+#define HEAP_TAG_API              6
+#define HEAP_TAG_COUNT            7
+
+struct HeapTagStats
+{
+  uint32_t allocCount;
+  uint32_t freeCount;
+  uint32_t liveBytes;
+  uint32_t peakBytes;
+};
+
+class HSG_HEAP
+{
+public:
+  // Tracked allocation primitives
+  static void * allocate(uint8_t tag, size_t size);
+  static void * reallocate(void * ptr, size_t size);
+  static void deallocate(void * ptr);
+
+  // Counters (total allocations is handy for asserting a zero-allocation steady state)
+  static const HeapTagStats * getStats(uint8_t tag);
+  static const char * getTagName(uint8_t tag);
+  static uint32_t getAllocCount(void);
+  static uint32_t getLiveBytes(void);
+  static void reset(void);
+
+  void setConfigSchema(JsonVariant json);
+  void conf(JsonVariant json);
+  void tele(JsonVariant json);
+
+private:
+  uint32_t _updateMs = DEFAULT_HEAP_UPDATE_MS;
+  uint32_t _lastUpdate;
+};
+
+// ArduinoJson allocator which attributes document memory to a call-site tag
+template <uint8_t TAG>
+struct HSG_HeapAllocator
+{
+  void * allocate(size_t size) { return HSG_HEAP::allocate(TAG, size); }
+  void deallocate(void * ptr) { HSG_HEAP::deallocate(ptr); }
+  void * reallocate(void * ptr, size_t size) { return HSG_HEAP::reallocate(ptr, size); }
+};
+
+// Drop-in replacement for DynamicJsonDocument
+template <uint8_t TAG>
+using TrackedJsonDocument = BasicJsonDocument<HSG_HeapAllocator<TAG>>;
+
+#endif
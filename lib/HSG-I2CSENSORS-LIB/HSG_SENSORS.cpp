@@ -19,6 +19,80 @@ double roundTo1Dp(double value)
   return (int)(value * 10.0) / 10.0;
 }
 
+// SHT4x CRC-8 (polynomial 0x31, init 0xFF) over a 16-bit word
+uint8_t sht40Crc(const uint8_t * data)
+{
+  uint8_t crc = 0xFF;
+  for (uint8_t i = 0; i < 2; i++)
+  {
+    crc ^= data[i];
+    for (uint8_t bit = 0; bit < 8; bit++)
+    {
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x31 : (crc << 1);
+    }
+  }
+  return crc;
+}
+
+void SensorChannel::add(float value, float alpha)
+{
+  if (isnan(value)) { return; }
+
+  // Replace the oldest sample once the ring is full
+  float evicted = NAN;
+  if (count == SENSOR_RING_SIZE)
+  {
+    evicted = samples[head];
+    sum -= evicted;
+  }
+  else
+  {
+    count++;
+  }
+
+  samples[head] = value;
+  head = (head + 1) % SENSOR_RING_SIZE;
+  sum += value;
+  last = value;
+  sequence++;
+
+  // Only rescan the ring if we just dropped the current min or max
+  if (evicted == minimum || evicted == maximum)
+  {
+    minimum = maximum = value;
+    for (uint8_t i = 0; i < count; i++)
+    {
+      if (samples[i] < minimum) { minimum = samples[i]; }
+      if (samples[i] > maximum) { maximum = samples[i]; }
+    }
+  }
+  else
+  {
+    if (isnan(minimum) || value < minimum) { minimum = value; }
+    if (isnan(maximum) || value > maximum) { maximum = value; }
+  }
+
+  // Re-sum once per lap so float rounding can't accumulate
+  if (head == 0)
+  {
+    sum = 0;
+    for (uint8_t i = 0; i < count; i++) { sum += samples[i]; }
+  }
+
+  ema = isnan(ema) ? value : ema + alpha * (value - ema);
+}
+
+float SensorChannel::mean(void)
+{
+  return count ? sum / count : NAN;
+}
+
+bool SensorChannel::changed(void)
+{
+  if (delta <= 0 || isnan(ema)) { return false; }
+  return isnan(reported) || fabs(ema - reported) > delta;
+}
+
 void HSG_SENSORS::begin()
 {
   Serial.println(F("[sens] scanning for I2C devices..."));
@@ -30,12 +104,8 @@ void HSG_SENSORS::begin()
 
   if (scanI2CAddress(SHT40_I2C_ADDRESS, "SHT40"))
   {
+    // Measurements are triggered/collected directly, see _triggerSht40()
     _sht40Found = _sht40.begin();
-    if (_sht40Found)
-    {
-      _sht40.setPrecision(SHT4X_MED_PRECISION);
-      _sht40.setHeater(SHT4X_NO_HEATER);
-    }
   }
 
   if (scanI2CAddress(MCP9808_I2C_ADDRESS, "MCP9808"))
@@ -46,6 +116,95 @@ void HSG_SENSORS::begin()
       _mcp9808.setResolution(MCP9808_MODE);
     }
   }
+
+  // Take the first samples straight away
+  uint32_t now = millis();
+  _mcp9808LastMs = now - _mcp9808SampleMs;
+  _bh1750LastMs = now - _bh1750SampleMs;
+  _sht40LastMs = now - _sht40SampleMs;
+}
+
+void HSG_SENSORS::loop()
+{
+  uint32_t now = millis();
+
+  // Collect a finished SHT40 conversion, or start a new one when due
+  if (_sht40State == SENSOR_MEASURING)
+  {
+    if ((now - _sht40LastMs) >= SHT40_MEASURE_MS)
+    {
+      _collectSht40();
+      return;
+    }
+  }
+  else if (_sht40Found && (now - _sht40LastMs) >= _sht40SampleMs)
+  {
+    _triggerSht40();
+    return;
+  }
+
+  // MCP9808 converts continuously so a register read is all we need
+  if (_mcp9808Found && (now - _mcp9808LastMs) >= _mcp9808SampleMs)
+  {
+    _sampleMcp9808();
+    return;
+  }
+
+  // BH1750 runs in continuous mode, only read once a conversion is ready
+  if (_bh1750Found && (now - _bh1750LastMs) >= _bh1750SampleMs && _bh1750.measurementReady())
+  {
+    _sampleBh1750();
+    return;
+  }
+}
+
+void HSG_SENSORS::_sampleMcp9808()
+{
+  _temperature.add(_mcp9808.readTempC(), _emaAlpha);
+  _mcp9808LastMs = millis();
+}
+
+void HSG_SENSORS::_sampleBh1750()
+{
+  _lux.add(_bh1750.readLightLevel(), _emaAlpha);
+  _bh1750LastMs = millis();
+}
+
+void HSG_SENSORS::_triggerSht40()
+{
+  // Start a conversion, the result is collected SHT40_MEASURE_MS later
+  Wire.beginTransmission(SHT40_I2C_ADDRESS);
+  Wire.write(SHT40_MEASURE_MED_PRECISION);
+  if (Wire.endTransmission() == 0)
+  {
+    _sht40State = SENSOR_MEASURING;
+  }
+
+  _sht40LastMs = millis();
+}
+
+void HSG_SENSORS::_collectSht40()
+{
+  _sht40State = SENSOR_IDLE;
+
+  uint8_t data[6];
+  if (Wire.requestFrom((uint8_t)SHT40_I2C_ADDRESS, (uint8_t)6) != 6) { return; }
+  for (uint8_t i = 0; i < 6; i++)
+  {
+    data[i] = Wire.read();
+  }
+
+  // Ignore the reading if either word fails its checksum
+  if (sht40Crc(&data[0]) != data[2] || sht40Crc(&data[3]) != data[5]) { return; }
+
+  uint16_t rawTemperature = (data[0] << 8) | data[1];
+  uint16_t rawHumidity = (data[3] << 8) | data[4];
+
+  if (!_mcp9808Found)
+  {
+    _temperature.add(-45.0 + (175.0 * rawTemperature / 65535.0), _emaAlpha);
+  }
+  _humidity.add(constrain(-6.0 + (125.0 * rawHumidity / 65535.0), 0.0, 100.0), _emaAlpha);
 }
 
 bool HSG_SENSORS::scanI2CAddress(byte address, const char * name)
@@ -72,11 +231,36 @@ void HSG_SENSORS::setConfigSchema(JsonVariant json)
 {
   JsonObject _updateSeconds = json.createNestedObject("sensorUpdateSeconds");
   _updateSeconds["title"] = "Sensor Update Interval (seconds)";
-  _updateSeconds["description"] = "How often to read and report values from the connected I2C sensors (defaults to 60 seconds, setting to 0 disables sensor reports). Must be a number between 0 and 86400 (i.e. 1 day).";
+  _updateSeconds["description"] = "How often to report values from the connected I2C sensors (defaults to 60 seconds, setting to 0 disables interval reports). Must be a number between 0 and 86400 (i.e. 1 day).";
   _updateSeconds["type"] = "integer";
   _updateSeconds["minimum"] = 0;
   _updateSeconds["maximum"] = 86400;
 
+  JsonObject _sampleMs = json.createNestedObject("sensorSampleMs");
+  _sampleMs["title"] = "Sensor Sample Intervals (ms)";
+  _sampleMs["description"] = "How often each sensor is sampled into its rolling statistics (defaults to 5000ms, or 1000ms for lux).";
+  _sampleMs["type"] = "object";
+  JsonObject _sampleMsProperties = _sampleMs.createNestedObject("properties");
+  _sampleMsProperties["mcp9808"]["type"] = "integer";
+  _sampleMsProperties["sht40"]["type"] = "integer";
+  _sampleMsProperties["bh1750"]["type"] = "integer";
+
+  JsonObject _delta = json.createNestedObject("sensorReportDelta");
+  _delta["title"] = "Sensor Change Thresholds";
+  _delta["description"] = "Report a value as soon as its smoothed reading moves by more than this since the last report (0 or unset only reports on the update interval).";
+  _delta["type"] = "object";
+  JsonObject _deltaProperties = _delta.createNestedObject("properties");
+  _deltaProperties["temperature"]["type"] = "number";
+  _deltaProperties["humidity"]["type"] = "number";
+  _deltaProperties["lux"]["type"] = "number";
+
+  JsonObject _alpha = json.createNestedObject("sensorSmoothing");
+  _alpha["title"] = "Sensor Smoothing Factor";
+  _alpha["description"] = "Weight given to each new sample in the exponential moving average (defaults to 0.2).";
+  _alpha["type"] = "number";
+  _alpha["minimum"] = 0.01;
+  _alpha["maximum"] = 1;
+
   if (_mcp9808Found || _sht40Found)
   {
     JsonObject _tempUnits = json.createNestedObject("sensorTempUnits");
@@ -104,6 +288,27 @@ void HSG_SENSORS::conf(JsonVariant json)
     _updateMs = json["sensorUpdateSeconds"].as<uint32_t>() * 1000L;
   }
 
+  if (json.containsKey("sensorSampleMs"))
+  {
+    JsonObject sampleMs = json["sensorSampleMs"];
+    if (sampleMs.containsKey("mcp9808")) { _mcp9808SampleMs = max(sampleMs["mcp9808"].as<uint32_t>(), (uint32_t)100); }
+    if (sampleMs.containsKey("sht40")) { _sht40SampleMs = max(sampleMs["sht40"].as<uint32_t>(), (uint32_t)100); }
+    if (sampleMs.containsKey("bh1750")) { _bh1750SampleMs = max(sampleMs["bh1750"].as<uint32_t>(), (uint32_t)100); }
+  }
+
+  if (json.containsKey("sensorReportDelta"))
+  {
+    JsonObject delta = json["sensorReportDelta"];
+    _temperature.delta = delta["temperature"] | 0.0;
+    _humidity.delta = delta["humidity"] | 0.0;
+    _lux.delta = delta["lux"] | 0.0;
+  }
+
+  if (json.containsKey("sensorSmoothing"))
+  {
+    _emaAlpha = constrain(json["sensorSmoothing"].as<float>(), 0.01f, 1.0f);
+  }
+
   if (json.containsKey("sensorTempUnits"))
   {
     if (strcmp(json["sensorTempUnits"], "c") == 0)
@@ -124,69 +329,57 @@ void HSG_SENSORS::cmnd(JsonVariant json)
 
 void HSG_SENSORS::tele(JsonVariant json)
 {
-  // Ignore if sensor publishing has been disabled
-  if (_updateMs == 0) { return; }
+  // Report on the update interval (unless disabled) or as soon as a value moves past its threshold
+  bool intervalDue = (_updateMs != 0) && ((millis() - _lastUpdate) > _updateMs);
+  bool changeDue = _temperature.changed() || _humidity.changed() || _lux.changed();
 
-  // Check if we are ready to publish
-  if ((millis() - _lastUpdate) > _updateMs)
-  {
-    float temperature = NAN;
-    float humidity = NAN;
-    float lux = NAN;
+  if (!intervalDue && !changeDue) { return; }
 
-    // Earlier sensors in these checks have precedence
-    if (_mcp9808Found)
-    {
-      temperature = _mcp9808.readTempC();
-    }
+  _addChannelJson(json, "temperature", "temperatureStats", &_temperature, true);
+  _addChannelJson(json, "humidity", "humidityStats", &_humidity, false);
+  _addChannelJson(json, "lux", "luxStats", &_lux, false);
 
-    if (_sht40Found)
-    {
-      sensors_event_t humid, temp;
-      _sht40.getEvent(&humid, &temp);
-
-      if (isnan(temperature))
-      {
-        temperature = temp.temperature;
-      }
-      
-      if (isnan(humidity))
-      {
-        humidity = humid.relative_humidity;
-      }
-    }
+  // Reset our timer
+  _lastUpdate = millis();
+}
 
-    if (_bh1750Found && _bh1750.measurementReady())
-    {
-      if (isnan(lux))
-      {
-        lux = _bh1750.readLightLevel();
-      }
-    }
+const SensorChannel * HSG_SENSORS::getTemperature()
+{
+  return &_temperature;
+}
 
-    if (!isnan(temperature))
-    {
-      if (_tempUnits == TEMP_F)
-      {
-        json["temperature"] = roundTo1Dp((temperature * 1.8) + 32);
-      }
-      else
-      {
-        json["temperature"] = roundTo1Dp(temperature);
-      }
-    }
+const SensorChannel * HSG_SENSORS::getHumidity()
+{
+  return &_humidity;
+}
 
-    if (!isnan(humidity))
-    {
-      json["humidity"] = roundTo1Dp(humidity);
-    }
+const SensorChannel * HSG_SENSORS::getLux()
+{
+  return &_lux;
+}
 
-    if (!isnan(lux))
-    {
-      json["lux"] = roundTo1Dp(lux);
-    }
+void HSG_SENSORS::_addChannelJson(JsonVariant json, const char * name, const char * statsName, SensorChannel * channel, bool temperature)
+{
+  if (channel->count == 0) { return; }
 
-    // Reset our timer
-    _lastUpdate = millis();
+  json[name] = roundTo1Dp(_toUnits(channel->last, temperature));
+
+  // Literal keys are stored by reference, keeping the report small enough for the telemetry document
+  JsonObject stats = json[statsName].to<JsonObject>();
+  stats["min"] = roundTo1Dp(_toUnits(channel->minimum, temperature));
+  stats["max"] = roundTo1Dp(_toUnits(channel->maximum, temperature));
+  stats["mean"] = roundTo1Dp(_toUnits(channel->mean(), temperature));
+  stats["ema"] = roundTo1Dp(_toUnits(channel->ema, temperature));
+  stats["samples"] = channel->count;
+
+  channel->reported = channel->ema;
+}
+
+float HSG_SENSORS::_toUnits(float value, bool temperature)
+{
+  if (temperature && _tempUnits == TEMP_F)
+  {
+    return (value * 1.8) + 32;
   }
-}
\ No newline at end of file
+  return value;
+}
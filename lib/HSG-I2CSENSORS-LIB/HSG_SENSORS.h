@@ -5,6 +5,12 @@
 #include <ArduinoJson.h>
 
 #define DEFAULT_UPDATE_MS 60000
+#define DEFAULT_SAMPLE_MS 5000
+#define DEFAULT_LUX_SAMPLE_MS 1000
+#define DEFAULT_EMA_ALPHA 0.2
+
+// Number of recent samples kept per value for min/max/mean
+#define SENSOR_RING_SIZE 16
 
 // Temperature units
 #define TEMP_C 0
@@ -16,14 +22,44 @@
 
 // SHT40 temperature and humidity sensor
 #define SHT40_I2C_ADDRESS 0x44
+#define SHT40_MEASURE_MED_PRECISION 0xF6
+#define SHT40_MEASURE_MS 5
 
 // BH1750 LUX sensor
 #define BH1750_I2C_ADDRESS 0x23 // or 0x5C
 
+// Acquisition states
+#define SENSOR_IDLE 0
+#define SENSOR_MEASURING 1
+
+// Recent samples and rolling statistics for a single sensor value
+struct SensorChannel
+{
+  float   samples[SENSOR_RING_SIZE];
+  uint8_t head = 0;
+  uint8_t count = 0;
+
+  float   sum = 0;
+  float   minimum = NAN;
+  float   maximum = NAN;
+  float   ema = NAN;
+  float   last = NAN;
+  uint32_t sequence = 0;
+
+  // Report early once the EMA moves this far from the last report (0 disables)
+  float   delta = 0;
+  float   reported = NAN;
+
+  void add(float value, float alpha);
+  float mean(void);
+  bool changed(void);
+};
+
 class HSG_SENSORS
 {
 public:
   void begin();
+  void loop();
 
   void setConfigSchema(JsonVariant json);
   void setCommandSchema(JsonVariant json);
@@ -33,6 +69,11 @@ public:
 
   void tele(JsonVariant json);
 
+  // Rolling readings for on-device control loops (sequence increments on each new sample)
+  const SensorChannel * getTemperature();
+  const SensorChannel * getHumidity();
+  const SensorChannel * getLux();
+
 private:
   uint32_t _updateMs = DEFAULT_UPDATE_MS;
   uint32_t _lastUpdate;
@@ -43,7 +84,30 @@ private:
   bool _bh1750Found = false;
   bool _sht40Found = false;
 
+  // Rolling readings, MCP9808 temperature has precedence over the SHT40
+  SensorChannel _temperature;
+  SensorChannel _humidity;
+  SensorChannel _lux;
+  float _emaAlpha = DEFAULT_EMA_ALPHA;
+
+  // Acquisition timing, loop() does at most one I2C transaction per call
+  uint32_t _mcp9808SampleMs = DEFAULT_SAMPLE_MS;
+  uint32_t _sht40SampleMs = DEFAULT_SAMPLE_MS;
+  uint32_t _bh1750SampleMs = DEFAULT_LUX_SAMPLE_MS;
+  uint32_t _mcp9808LastMs;
+  uint32_t _bh1750LastMs;
+  uint32_t _sht40LastMs;
+  uint8_t  _sht40State = SENSOR_IDLE;
+
   bool scanI2CAddress(byte address, const char * name);
+
+  void _sampleMcp9808();
+  void _sampleBh1750();
+  void _triggerSht40();
+  void _collectSht40();
+
+  void _addChannelJson(JsonVariant json, const char * name, const char * statsName, SensorChannel * channel, bool temperature);
+  float _toUnits(float value, bool temperature);
 };
 
 #endif
@@ -16,9 +16,10 @@ static const char * MQTT_COMMAND_TOPIC    = "cmnd";
 static const char * MQTT_STATUS_TOPIC     = "stat";
 static const char * MQTT_TELEMETRY_TOPIC  = "tele";
 
-HSG_MQTT::HSG_MQTT(PubSubClient& client)
+HSG_MQTT::HSG_MQTT(PubSubClient& client, HSG_MQTT_CLIENT* transport)
 {
   this->_client = &client;
+  this->_transport = transport;
 
   // Set the buffer size (depends on MCU we are running on)
   _client->setBufferSize(MQTT_MAX_MESSAGE_SIZE);
@@ -31,11 +32,14 @@ char * HSG_MQTT::getClientId(void)
 
 void HSG_MQTT::setClientId(const char * clientId)
 {
+  // A different client id is a different session on the broker
+  if (strcmp(_clientId, clientId) != 0) { _subscribed = false; }
   strcpy(_clientId, clientId);
 }
 
 void HSG_MQTT::setBroker(const char * broker, uint16_t port)
 {
+    if (strcmp(_broker, broker) != 0 || _port != port) { _subscribed = false; }
     strcpy(_broker, broker);
     _port = port;
 }
@@ -56,6 +60,9 @@ void HSG_MQTT::setAuth(const char * username, const char * password)
 
 void HSG_MQTT::setTopicPrefix(const char * prefix)
 {
+  char previous[32];
+  strcpy(previous, _topicPrefix);
+
   if (prefix == NULL)
   {
     _topicPrefix[0] = '\0';
@@ -69,10 +76,15 @@ void HSG_MQTT::setTopicPrefix(const char * prefix)
       strcat(_topicPrefix, "/");
     }
   }
+
+  // Subscriptions held by the broker are for the old topics
+  if (strcmp(previous, _topicPrefix) != 0) { _subscribed = false; }
 }
 
 void HSG_MQTT::setTopicSuffix(const char * suffix)
 {
+  if (strcmp(_topicSuffix, suffix ? suffix : "") != 0) { _subscribed = false; }
+
   if (suffix == NULL)
   {
     _topicSuffix[0] = '\0';
@@ -83,6 +95,27 @@ void HSG_MQTT::setTopicSuffix(const char * suffix)
   }
 }
 
+void HSG_MQTT::setProtocolVersion(uint8_t version)
+{
+  if (_transport) { _transport->setProtocolVersion(version); }
+}
+
+void HSG_MQTT::setSessionExpiry(uint32_t seconds)
+{
+  if (_transport) { _transport->setSessionExpiry(seconds); }
+}
+
+void HSG_MQTT::setPersistentSession(bool persistent)
+{
+  if (persistent != _persistentSession) { _subscribed = false; }
+  _persistentSession = persistent;
+}
+
+bool HSG_MQTT::isSessionResumed(void)
+{
+  return _sessionResumed;
+}
+
 char * HSG_MQTT::getWildcardTopic(char topic[])
 {
   return _getTopic(topic, "+");
@@ -168,6 +201,9 @@ int HSG_MQTT::loop(void)
   // Let the MQTT client handle any messages
   if (_client->loop())
   {
+    // Retransmit any unacknowledged QoS 1 publishes
+    if (_transport) { _transport->loop(); }
+
     // Currently connected so ensure we are ready to reconnect if it drops
     _backoff = 0;
     _lastReconnectMs = millis();
@@ -206,7 +242,7 @@ int HSG_MQTT::receive(char * topic, byte * payload, unsigned int length)
   char * topicType;
   topicType = strtok(&topic[strlen(_topicPrefix)], "/");
 
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_MQTT> json(1024);
   DeserializationError error = deserializeJson(json, payload);
   if (error) { return MQTT_RECEIVE_JSON_ERROR; }
 
@@ -240,6 +276,20 @@ void HSG_MQTT::reconnect(void)
   _lastReconnectMs = millis();
 }
 
+void HSG_MQTT::resubscribe(void)
+{
+  _subscribed = false;
+}
+
+bool HSG_MQTT::subscribe(const char * topic)
+{
+  if (_client->subscribe(topic, MQTT_SUBSCRIBE_QOS)) { return true; }
+
+  // The broker can't be relied on to have all of our subscriptions now
+  _subscribed = false;
+  return false;
+}
+
 bool HSG_MQTT::publishAdopt(JsonVariant json)
 {
   char topic[64];
@@ -258,6 +308,18 @@ bool HSG_MQTT::publishTelemetry(JsonVariant json)
   return publish(json, getTelemetryTopic(topic), false);
 }
 
+void HSG_MQTT::tele(JsonVariant json)
+{
+  if (!_transport) { return; }
+
+  JsonObject mqtt = json["mqtt"].to<JsonObject>();
+  mqtt["protocolVersion"] = _transport->getProtocolVersion();
+  mqtt["inflight"] = _transport->getInflightCount();
+  mqtt["retransmits"] = _transport->getRetransmitCount();
+  mqtt["overflows"] = _transport->getOverflowCount();
+  mqtt["batches"] = _transport->getBatchCount();
+}
+
 bool HSG_MQTT::publish(JsonVariant json, char * topic, bool retained)
 {
   if (!_client->connected()) { return false; }
@@ -285,7 +347,7 @@ bool HSG_MQTT::_connect(void)
   _client->setServer(_broker, _port);
 
   // Build our LWT payload
-  DynamicJsonDocument lwtJson(1024);
+  TrackedJsonDocument<HEAP_TAG_MQTT> lwtJson(1024);
   lwtJson["online"] = false;
 
   // Get our LWT offline payload as raw string
@@ -294,12 +356,21 @@ bool HSG_MQTT::_connect(void)
 
   // Attempt to connect to the MQTT broker
   char topic[64];
-  bool success = _client->connect(_clientId, _username, _password, getLwtTopic(topic), 0, true, lwtBuffer);
+  // After a reboot (or any change to our topics) we can't know what an old session holds, so start afresh
+  bool cleanSession = !_persistentSession || !_subscribed;
+  bool success = _client->connect(_clientId, _username, _password, getLwtTopic(topic), 0, true, lwtBuffer, cleanSession);
   if (success)
   {
+    // The broker only kept our subscriptions if it says our session is present
+    _sessionResumed = _persistentSession && _subscribed && _transport && _transport->isSessionPresent();
+    _subscribed = true;
+
     // Subscribe to our config and command topics
-    _client->subscribe(getConfigTopic(topic));
-    _client->subscribe(getCommandTopic(topic));
+    if (!_sessionResumed)
+    {
+      subscribe(getConfigTopic(topic));
+      subscribe(getCommandTopic(topic));
+    }
 
     // Publish our LWT online payload now we are ready
     lwtJson["online"] = true;
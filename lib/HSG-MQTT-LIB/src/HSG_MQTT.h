@@ -9,6 +9,8 @@
 #include "Arduino.h"
 #include <ArduinoJson.h>
 #include <PubSubClient.h>
+#include <HSG_HEAP.h>
+#include "HSG_MQTT_CLIENT.h"
 
 // Increase the max MQTT message size for ESP or RPi based MCUs
 #if defined (ESP32)
@@ -31,6 +33,10 @@
 #define MQTT_MAX_BACKOFF_COUNT          12
 #define MQTT_STREAMING_BUFFER_SIZE      64
 
+// Persistent sessions, subscriptions are QoS 1 so the broker queues commands while we are away
+#define MQTT_SUBSCRIBE_QOS              1
+#define MQTT_DEFAULT_SESSION_EXPIRY     3600
+
 // Return codes for loop()
 #define MQTT_CONNECTED                  0
 #define MQTT_RECONNECT_BACKING_OFF      1
@@ -55,7 +61,8 @@ typedef void (* jsonCallback)(JsonVariant);
 class HSG_MQTT
 {
   public:
-    HSG_MQTT(PubSubClient& client);
+    // Pass the transport PubSubClient is using to have it looked after (QoS 1, MQTT 5)
+    HSG_MQTT(PubSubClient& client, HSG_MQTT_CLIENT* transport = NULL);
 
     char * getClientId(void);
     void setClientId(const char * clientId);
@@ -65,6 +72,16 @@ class HSG_MQTT
     void setTopicPrefix(const char * prefix);
     void setTopicSuffix(const char * suffix);
 
+    // MQTT 5 (falls back to 3.1.1 if the broker refuses) and its session expiry, need a transport
+    void setProtocolVersion(uint8_t version);
+    void setSessionExpiry(uint32_t seconds);
+
+    // Keep our session (and subscriptions) on the broker across reconnects
+    void setPersistentSession(bool persistent);
+
+    // True if the broker still had everything we subscribed to, so no need to again
+    bool isSessionResumed(void);
+
     char * getWildcardTopic(char topic[]);
     char * getLwtTopic(char topic[]);
     char * getAdoptTopic(char topic[]);
@@ -90,13 +107,23 @@ class HSG_MQTT
     bool connected(void);
     void reconnect(void);
 
+    // Subscribe at MQTT_SUBSCRIBE_QOS, a failure means resubscribing on the next connect
+    bool subscribe(const char * topic);
+
+    // Start a clean session and subscribe to everything again on the next connect
+    void resubscribe(void);
+
     bool publishAdopt(JsonVariant json);
     bool publishStatus(JsonVariant json);
     bool publishTelemetry(JsonVariant json);
     bool publish(JsonVariant json, char * topic, bool retained);
 
+    // Adds the transport's QoS and batching counters (if there is a transport)
+    void tele(JsonVariant json);
+
   private:
     PubSubClient* _client;
+    HSG_MQTT_CLIENT* _transport;
 
     char _broker[32];
     uint16_t _port = MQTT_DEFAULT_PORT;
@@ -106,6 +133,10 @@ class HSG_MQTT
     char _topicPrefix[32];
     char _topicSuffix[32];
 
+    bool _persistentSession = true;
+    bool _subscribed = false;                 // subscriptions made on this broker since boot
+    bool _sessionResumed = false;
+
     uint8_t _backoff;
     uint32_t _lastReconnectMs;
     bool _connect(void);
@@ -0,0 +1,1030 @@
+/*
+ * HSG_MQTT_CLIENT.cpp
+ */
+
+#include "Arduino.h"
+#include "HSG_MQTT_CLIENT.h"
+
+// Outgoing framing states
+#define OUT_HEADER          0
+#define OUT_LENGTH          1
+#define OUT_BODY            2
+#define OUT_PASSTHROUGH     3
+
+// Incoming framing states
+#define IN_HEADER           0
+#define IN_LENGTH           1
+#define IN_BODY             2
+#define IN_ACK_LENGTH       3
+#define IN_ACK_BODY         4
+#define IN_X_LENGTH         5
+#define IN_X_CONNACK        6
+#define IN_X_TOPIC          7
+#define IN_X_PROPS_LENGTH   8
+#define IN_X_PROPS          9
+
+/*
+ * Write a fixed header (type byte and remaining length), returns its size
+ */
+static uint8_t _encodeHeader(uint8_t * out, uint8_t header, uint32_t length)
+{
+  uint8_t size = 0;
+  out[size++] = header;
+  do
+  {
+    uint8_t b = length % 128;
+    length /= 128;
+    out[size++] = length ? (b | 0x80) : b;
+  } while (length);
+  return size;
+}
+
+/*
+ * Size of an MQTT 5 property value, -1 if unknown or truncated
+ */
+static int _propertySize(uint8_t id, const uint8_t * p, uint32_t available)
+{
+  switch (id)
+  {
+    case 0x01: case 0x17: case 0x19: case 0x24: case 0x25: case 0x28: case 0x29: case 0x2A:
+      return 1;
+
+    case 0x13: case 0x21: case 0x22: case 0x23:
+      return 2;
+
+    case 0x02: case 0x11: case 0x18: case 0x27:
+      return 4;
+
+    case 0x0B:
+      for (uint32_t i = 0; i < available && i < 4; i++)
+      {
+        if (!(p[i] & 0x80)) { return i + 1; }
+      }
+      return -1;
+
+    case 0x03: case 0x08: case 0x09: case 0x12: case 0x15: case 0x16: case 0x1A: case 0x1C: case 0x1F:
+      if (available < 2) { return -1; }
+      return 2 + ((p[0] << 8) | p[1]);
+
+    case 0x26:
+    {
+      if (available < 2) { return -1; }
+      uint32_t key = 2 + ((p[0] << 8) | p[1]);
+      if (available < key + 2) { return -1; }
+      return key + 2 + ((p[key] << 8) | p[key + 1]);
+    }
+  }
+  return -1;
+}
+
+/*
+ * Map an MQTT 5 CONNACK reason code onto the 3.1.1 return code PubSubClient understands
+ */
+static uint8_t _mapReasonCode(uint8_t reason)
+{
+  switch (reason)
+  {
+    case 0x00: return 0;
+    case MQTT_RETURN_BAD_PROTOCOL:
+    case MQTT_REASON_UNSUPPORTED_VERSION: return 1;
+    case 0x85: return 2;                  // client identifier not valid
+    case 0x86: return 4;                  // bad user name or password
+    case 0x87: case 0x8C: return 5;       // not authorised, bad authentication method
+    default: return 3;                    // anything else, treat as unavailable
+  }
+}
+
+HSG_MQTT_CLIENT::HSG_MQTT_CLIENT(Client& client)
+{
+  this->_client = &client;
+
+  _qosPrefix[0] = '\0';
+  for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+  {
+    _inflight[i].packetId = 0;
+  }
+
+  _reset();
+}
+
+void HSG_MQTT_CLIENT::setLogger(Print * logger)
+{
+  _logger = logger;
+}
+
+void HSG_MQTT_CLIENT::setQosPrefix(const char * prefix)
+{
+  if (prefix == NULL || strlen(prefix) >= MQTT_QOS_PREFIX_SIZE)
+  {
+    _qosPrefix[0] = '\0';
+  }
+  else
+  {
+    strcpy(_qosPrefix, prefix);
+  }
+}
+
+void HSG_MQTT_CLIENT::setProtocolVersion(uint8_t version)
+{
+  _version = version;
+  _fallback = false;
+}
+
+uint8_t HSG_MQTT_CLIENT::getProtocolVersion(void)
+{
+  return _activeVersion;
+}
+
+void HSG_MQTT_CLIENT::setSessionExpiry(uint32_t seconds)
+{
+  _sessionExpiry = seconds;
+}
+
+bool HSG_MQTT_CLIENT::addAliasTopic(const char * topic)
+{
+  if (_aliasCount >= MQTT_ALIAS_COUNT || strlen(topic) >= MQTT_QOS_PREFIX_SIZE) { return false; }
+
+  strcpy(_aliasTopics[_aliasCount++], topic);
+  return true;
+}
+
+void HSG_MQTT_CLIENT::clearAliasTopics(void)
+{
+  // Aliases already set up on this connection would now point at the wrong topic
+  _aliasCount = 0;
+  _aliasSent = 0;
+}
+
+uint8_t HSG_MQTT_CLIENT::getReasonCode(void)
+{
+  return _reasonCode;
+}
+
+bool HSG_MQTT_CLIENT::isSessionPresent(void)
+{
+  return _sessionPresent;
+}
+
+void HSG_MQTT_CLIENT::loop(void)
+{
+  if (!_client->connected()) { return; }
+
+  // Everything still in flight is resent once the broker has accepted a (re)connect,
+  // 3.1.1 also resends anything unacknowledged for too long but MQTT 5 forbids that
+  uint32_t now = millis();
+  bool retry = _activeVersion < MQTT_VERSION_5;
+  for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+  {
+    MqttInflight * slot = &_inflight[i];
+    if (slot->packetId == 0) { continue; }
+    if (!_resendAll && (!retry || (now - slot->sentMs) < MQTT_QOS_RETRY_MS)) { continue; }
+
+    slot->packet[0] |= MQTT_PUBLISH_DUP;
+    slot->sentMs = now;
+    _transmit(slot->packet, slot->length);
+    _retransmits++;
+  }
+  _resendAll = false;
+
+  // Nothing published since the last frame should wait any longer
+  sendBatch();
+}
+
+uint8_t HSG_MQTT_CLIENT::getInflightCount(void)
+{
+  uint8_t count = 0;
+  for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+  {
+    if (_inflight[i].packetId != 0) { count++; }
+  }
+  return count;
+}
+
+uint32_t HSG_MQTT_CLIENT::getRetransmitCount(void)
+{
+  return _retransmits;
+}
+
+uint32_t HSG_MQTT_CLIENT::getOverflowCount(void)
+{
+  return _overflows;
+}
+
+void HSG_MQTT_CLIENT::sendBatch(void)
+{
+  if (_batchLength == 0) { return; }
+
+  _write(_batch, _batchLength);
+  _batchLength = 0;
+  _batchWrites++;
+}
+
+uint32_t HSG_MQTT_CLIENT::getBatchCount(void)
+{
+  return _batchWrites;
+}
+
+int HSG_MQTT_CLIENT::connect(IPAddress ip, uint16_t port)
+{
+  _reset();
+  _activeVersion = (_version >= MQTT_VERSION_5 && !_fallback) ? MQTT_VERSION_5 : MQTT_VERSION_3_1_1;
+  return _client->connect(ip, port);
+}
+
+int HSG_MQTT_CLIENT::connect(const char * host, uint16_t port)
+{
+  _reset();
+  _activeVersion = (_version >= MQTT_VERSION_5 && !_fallback) ? MQTT_VERSION_5 : MQTT_VERSION_3_1_1;
+  return _client->connect(host, port);
+}
+
+size_t HSG_MQTT_CLIENT::write(uint8_t b)
+{
+  return write(&b, 1);
+}
+
+/*
+ * PubSubClient writes a packet in one go, or in pieces when streaming a
+ * publish, so reassemble each packet before deciding what to do with it.
+ * Anything too big to hold is passed straight through
+ */
+size_t HSG_MQTT_CLIENT::write(const uint8_t * buf, size_t size)
+{
+  if (_writeFailed) { return 0; }
+
+  size_t i = 0;
+  while (i < size)
+  {
+    switch (_outState)
+    {
+      case OUT_HEADER:
+        _outPacket[0] = buf[i++];
+        _outLength = 1;
+        _outBodyLength = 0;
+        _outMultiplier = 1;
+        _outState = OUT_LENGTH;
+        break;
+
+      case OUT_LENGTH:
+      {
+        uint8_t b = buf[i++];
+        _outPacket[_outLength++] = b;
+        _outBodyLength += (b & 0x7F) * _outMultiplier;
+        _outMultiplier *= 128;
+        if ((b & 0x80) && _outLength < MQTT_MAX_FIXED_HEADER) { break; }
+
+        _outRemaining = _outBodyLength;
+        if (_outLength + _outBodyLength > MQTT_QOS_PACKET_SIZE)
+        {
+          _passInsert = _activeVersion >= MQTT_VERSION_5 && (_outPacket[0] & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_PUBLISH;
+          if (_passInsert)
+          {
+            // One more byte for the empty property length
+            uint8_t header[MQTT_MAX_FIXED_HEADER];
+            _passOut(header, _encodeHeader(header, _outPacket[0], _outBodyLength + 1));
+            _passOffset = 0;
+            _passInsertAt = 0;
+          }
+          else
+          {
+            _passOut(_outPacket, _outLength);
+          }
+          _outState = _outRemaining ? OUT_PASSTHROUGH : OUT_HEADER;
+        }
+        else if (_outRemaining == 0)
+        {
+          _packetOut();
+        }
+        else
+        {
+          _outState = OUT_BODY;
+        }
+        break;
+      }
+
+      case OUT_BODY:
+      {
+        size_t count = min((size_t)_outRemaining, size - i);
+        memcpy(&_outPacket[_outLength], &buf[i], count);
+        _outLength += count;
+        _outRemaining -= count;
+        i += count;
+        if (_outRemaining == 0) { _packetOut(); }
+        break;
+      }
+
+      case OUT_PASSTHROUGH:
+        if (_passInsert)
+        {
+          // Byte at a time until we are past the topic (and packet id)
+          uint8_t b = buf[i++];
+          _passOut(&b, 1);
+          _outRemaining--;
+          _passOffset++;
+
+          if (_passOffset == 1)
+          {
+            _passInsertAt = b << 8;
+          }
+          else if (_passOffset == 2)
+          {
+            _passInsertAt = 2 + (_passInsertAt | b) + ((_outPacket[0] & MQTT_PUBLISH_QOS_MASK) ? 2 : 0);
+          }
+
+          if (_passOffset >= 2 && _passOffset == _passInsertAt)
+          {
+            uint8_t empty = 0;
+            _passOut(&empty, 1);
+            _passInsert = false;
+          }
+        }
+        else
+        {
+          size_t count = min((size_t)_outRemaining, size - i);
+          _passOut(&buf[i], count);
+          _outRemaining -= count;
+          i += count;
+        }
+        if (_outRemaining == 0) { _outState = OUT_HEADER; }
+        break;
+    }
+  }
+
+  // PubSubClient treats a short write as a dead connection, which includes a
+  // batched write failing since the last call
+  return _writeFailed ? 0 : size;
+}
+
+/*
+ * Acknowledgements for our QoS 1 publishes are taken out of the stream here,
+ * and MQTT 5 packets are translated, so PubSubClient only ever sees the 3.1.1
+ * packets it expects
+ */
+int HSG_MQTT_CLIENT::available(void)
+{
+  if (!_pump()) { return 0; }
+  if (_stagePos < _stageLength) { return _stageLength - _stagePos; }
+  return _client->available();
+}
+
+int HSG_MQTT_CLIENT::read(void)
+{
+  if (available() <= 0) { return -1; }
+
+  int b;
+  if (_stagePos < _stageLength)
+  {
+    b = _stage[_stagePos++];
+    if (_stagePos >= _stageLength) { _stagePos = _stageLength = 0; }
+  }
+  else
+  {
+    b = _client->read();
+  }
+
+  if (b >= 0) { _trackInbound(b); }
+  return b;
+}
+
+int HSG_MQTT_CLIENT::read(uint8_t * buf, size_t size)
+{
+  size_t count = 0;
+  while (count < size)
+  {
+    int b = read();
+    if (b < 0) { break; }
+    buf[count++] = b;
+  }
+  return count;
+}
+
+int HSG_MQTT_CLIENT::peek(void)
+{
+  if (available() <= 0) { return -1; }
+  if (_stagePos < _stageLength) { return _stage[_stagePos]; }
+  return _client->peek();
+}
+
+void HSG_MQTT_CLIENT::flush(void)
+{
+  _client->flush();
+}
+
+void HSG_MQTT_CLIENT::stop(void)
+{
+  _client->stop();
+  _reset();
+}
+
+uint8_t HSG_MQTT_CLIENT::connected(void)
+{
+  return _client->connected();
+}
+
+HSG_MQTT_CLIENT::operator bool(void)
+{
+  return (bool)*_client;
+}
+
+void HSG_MQTT_CLIENT::_reset(void)
+{
+  // In-flight publishes are kept, they are resent after the next CONNACK
+  _outState = OUT_HEADER;
+  _inState = IN_HEADER;
+  _passInsert = false;
+  _stageLength = _stagePos = 0;
+  _batchLength = 0;
+  _aliasSent = 0;
+  _resendAll = false;
+  _writeFailed = false;
+}
+
+void HSG_MQTT_CLIENT::_packetOut(void)
+{
+  _outState = OUT_HEADER;
+
+  uint8_t header = _outPacket[0];
+  if ((header & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_PUBLISH && (header & MQTT_PUBLISH_QOS_MASK) == 0)
+  {
+    if (_publishQos1()) { return; }
+  }
+
+  _transmit(_outPacket, _outLength);
+}
+
+/*
+ * Re-frame a QoS 0 publish as QoS 1 (adding a packet id after the topic)
+ * into a free in-flight slot and send it, returns false to send as-is.
+ * Slots hold the 3.1.1 packet, so a retransmit is translated afresh for
+ * whichever connection it goes out on
+ */
+bool HSG_MQTT_CLIENT::_publishQos1(void)
+{
+  if (_qosPrefix[0] == '\0') { return false; }
+
+  const uint8_t * body = &_outPacket[_outLength - _outBodyLength];
+  if (_outBodyLength < 2) { return false; }
+
+  uint16_t topicLength = (body[0] << 8) | body[1];
+  size_t prefixLength = strlen(_qosPrefix);
+  if (topicLength + 2 > _outBodyLength || topicLength < prefixLength) { return false; }
+  if (memcmp(&body[2], _qosPrefix, prefixLength) != 0) { return false; }
+
+  // Room for the packet id and a remaining length which may grow a byte
+  if (_outLength + 3 > MQTT_QOS_PACKET_SIZE) { return false; }
+
+  MqttInflight * slot = NULL;
+  for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+  {
+    if (_inflight[i].packetId == 0) { slot = &_inflight[i]; break; }
+  }
+
+  // Window full, still worth sending at QoS 0
+  if (slot == NULL)
+  {
+    _overflows++;
+    return false;
+  }
+
+  uint8_t * packet = slot->packet;
+  uint16_t length = _encodeHeader(packet, _outPacket[0] | MQTT_PUBLISH_QOS1, _outBodyLength + 2);
+
+  memcpy(&packet[length], body, topicLength + 2);
+  length += topicLength + 2;
+
+  slot->packetId = _nextPacketId();
+  packet[length++] = slot->packetId >> 8;
+  packet[length++] = slot->packetId & 0xFF;
+
+  uint32_t payloadLength = _outBodyLength - (topicLength + 2);
+  memcpy(&packet[length], &body[topicLength + 2], payloadLength);
+  length += payloadLength;
+
+  slot->length = length;
+  slot->sentMs = millis();
+  _transmit(packet, length);
+  return true;
+}
+
+/*
+ * Send a complete 3.1.1 packet, adding what MQTT 5 requires when we are speaking it
+ */
+void HSG_MQTT_CLIENT::_transmit(const uint8_t * packet, uint32_t length)
+{
+  if (_activeVersion < MQTT_VERSION_5)
+  {
+    if ((packet[0] & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_PUBLISH)
+    {
+      _queue(packet, length);
+    }
+    else
+    {
+      _send(packet, length);
+    }
+    return;
+  }
+
+  uint8_t headerLength = 1;
+  while (headerLength < MQTT_MAX_FIXED_HEADER && (packet[headerLength] & 0x80)) { headerLength++; }
+  headerLength++;
+
+  const uint8_t * body = &packet[headerLength];
+  uint32_t bodyLength = length - headerLength;
+
+  switch (packet[0] & MQTT_PACKET_TYPE_MASK)
+  {
+    case MQTT_PACKET_CONNECT:
+      _transmitConnect(packet[0], body, bodyLength);
+      break;
+
+    case MQTT_PACKET_PUBLISH:
+      _transmitPublish(packet[0], body, bodyLength);
+      break;
+
+    case MQTT_PACKET_SUBSCRIBE:
+    case MQTT_PACKET_UNSUBSCRIBE:
+      // Empty properties after the packet id, 3.1.1 QoS bytes are valid subscription options
+      _transmitInsert(packet[0], body, bodyLength, 2);
+      break;
+
+    default:
+      // PINGREQ and DISCONNECT are the same in both
+      _send(packet, length);
+      break;
+  }
+}
+
+void HSG_MQTT_CLIENT::_transmitConnect(uint8_t header, const uint8_t * body, uint32_t bodyLength)
+{
+  // Protocol name, level, flags and keep alive, then the client id
+  if (bodyLength < 12) { return; }
+
+  uint8_t flags = body[7];
+  uint32_t willAt = 12 + ((body[10] << 8) | body[11]);
+  bool will = (flags & MQTT_CONNECT_WILL) != 0;
+  if (willAt > bodyLength) { return; }
+
+  uint8_t properties[6];
+  uint8_t propertiesLength = 0;
+  if (_sessionExpiry)
+  {
+    properties[propertiesLength++] = 5;
+    properties[propertiesLength++] = MQTT_PROPERTY_SESSION_EXPIRY;
+    properties[propertiesLength++] = _sessionExpiry >> 24;
+    properties[propertiesLength++] = _sessionExpiry >> 16;
+    properties[propertiesLength++] = _sessionExpiry >> 8;
+    properties[propertiesLength++] = _sessionExpiry;
+  }
+  else
+  {
+    properties[propertiesLength++] = 0;
+  }
+
+  uint32_t length = _encodeHeader(_txPacket, header, bodyLength + propertiesLength + (will ? 1 : 0));
+
+  memcpy(&_txPacket[length], body, 10);
+  _txPacket[length + 6] = MQTT_VERSION_5;
+  length += 10;
+
+  memcpy(&_txPacket[length], properties, propertiesLength);
+  length += propertiesLength;
+
+  memcpy(&_txPacket[length], &body[10], willAt - 10);
+  length += willAt - 10;
+
+  // Empty will properties ahead of the will topic
+  if (will) { _txPacket[length++] = 0; }
+
+  memcpy(&_txPacket[length], &body[willAt], bodyLength - willAt);
+  length += bodyLength - willAt;
+
+  _send(_txPacket, length);
+}
+
+void HSG_MQTT_CLIENT::_transmitPublish(uint8_t header, const uint8_t * body, uint32_t bodyLength)
+{
+  if (bodyLength < 2) { return; }
+
+  uint16_t topicLength = (body[0] << 8) | body[1];
+  uint8_t idLength = (header & MQTT_PUBLISH_QOS_MASK) ? 2 : 0;
+  uint32_t payloadAt = 2 + topicLength + idLength;
+  if (payloadAt > bodyLength) { return; }
+
+  // Hot topics are sent in full once per connection, then as a 2 byte alias
+  int alias = _findAlias(&body[2], topicLength);
+  bool omitTopic = alias && (_aliasSent & (1 << (alias - 1)));
+
+  uint32_t length = _encodeHeader(_txPacket, header, bodyLength + (alias ? 4 : 1) - (omitTopic ? topicLength : 0));
+
+  if (omitTopic)
+  {
+    _txPacket[length++] = 0;
+    _txPacket[length++] = 0;
+  }
+  else
+  {
+    memcpy(&_txPacket[length], body, 2 + topicLength);
+    length += 2 + topicLength;
+  }
+
+  memcpy(&_txPacket[length], &body[2 + topicLength], idLength);
+  length += idLength;
+
+  if (alias)
+  {
+    _txPacket[length++] = 3;
+    _txPacket[length++] = MQTT_PROPERTY_TOPIC_ALIAS;
+    _txPacket[length++] = alias >> 8;
+    _txPacket[length++] = alias & 0xFF;
+    _aliasSent |= 1 << (alias - 1);
+  }
+  else
+  {
+    _txPacket[length++] = 0;
+  }
+
+  memcpy(&_txPacket[length], &body[payloadAt], bodyLength - payloadAt);
+  length += bodyLength - payloadAt;
+
+  _queue(_txPacket, length);
+}
+
+/*
+ * Send a packet with an empty property length inserted at the given offset into its body
+ */
+void HSG_MQTT_CLIENT::_transmitInsert(uint8_t header, const uint8_t * body, uint32_t bodyLength, uint32_t offset)
+{
+  if (offset > bodyLength) { return; }
+
+  uint32_t length = _encodeHeader(_txPacket, header, bodyLength + 1);
+
+  memcpy(&_txPacket[length], body, offset);
+  length += offset;
+
+  _txPacket[length++] = 0;
+
+  memcpy(&_txPacket[length], &body[offset], bodyLength - offset);
+  length += bodyLength - offset;
+
+  _send(_txPacket, length);
+}
+
+/*
+ * Publishes are batched, so a burst of them (e.g. many outputs finishing a
+ * fade in the same frame) goes out in as few socket writes as possible
+ */
+void HSG_MQTT_CLIENT::_queue(const uint8_t * buf, size_t size)
+{
+  if (_batchLength + size > MQTT_BATCH_SIZE) { sendBatch(); }
+
+  if (size > MQTT_BATCH_SIZE)
+  {
+    _write(buf, size);
+    return;
+  }
+
+  memcpy(&_batch[_batchLength], buf, size);
+  _batchLength += size;
+}
+
+/*
+ * Anything else goes straight out (after whatever is batched, to keep the order),
+ * PubSubClient waits on the reply to a CONNECT or PINGREQ
+ */
+void HSG_MQTT_CLIENT::_send(const uint8_t * buf, size_t size)
+{
+  sendBatch();
+  _write(buf, size);
+}
+
+/*
+ * Batched writes happen outside PubSubClient's calls, so a failure is held
+ * until the next write() can report it, and the socket is dropped so
+ * PubSubClient notices the lost connection even if it never writes again
+ */
+void HSG_MQTT_CLIENT::_write(const uint8_t * buf, size_t size)
+{
+  if (_writeFailed) { return; }
+  if (_client->write(buf, size) == size) { return; }
+
+  _logger->println(F("[mqtt] socket write failed, dropping connection"));
+  _writeFailed = true;
+  _client->stop();
+}
+
+/*
+ * Oversized packets streamed straight through are batched if they are publishes
+ */
+void HSG_MQTT_CLIENT::_passOut(const uint8_t * buf, size_t size)
+{
+  if ((_outPacket[0] & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_PUBLISH)
+  {
+    _queue(buf, size);
+  }
+  else
+  {
+    _send(buf, size);
+  }
+}
+
+int HSG_MQTT_CLIENT::_findAlias(const uint8_t * topic, uint16_t topicLength)
+{
+  for (uint8_t i = 0; i < _aliasCount && i < _aliasMax; i++)
+  {
+    if (strlen(_aliasTopics[i]) == topicLength && memcmp(_aliasTopics[i], topic, topicLength) == 0)
+    {
+      return i + 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Consume any PUBACKs waiting at a packet boundary and translate incoming
+ * MQTT 5 packets onto the stage, returns false while part of a packet we
+ * are handling is still to arrive (so nothing is readable yet)
+ */
+bool HSG_MQTT_CLIENT::_pump(void)
+{
+  while (_stagePos >= _stageLength && _client->available() > 0)
+  {
+    switch (_inState)
+    {
+      case IN_HEADER:
+      {
+        uint8_t type = _client->peek() & MQTT_PACKET_TYPE_MASK;
+        if (type == MQTT_PACKET_PUBACK)
+        {
+          _client->read();
+          _inRemaining = 0;
+          _inMultiplier = 1;
+          _inState = IN_ACK_LENGTH;
+        }
+        else if (_activeVersion >= MQTT_VERSION_5 && (type == MQTT_PACKET_CONNACK || type == MQTT_PACKET_PUBLISH))
+        {
+          _xHeader = _client->read();
+          _xRemaining = 0;
+          _inMultiplier = 1;
+          _inState = IN_X_LENGTH;
+        }
+        else
+        {
+          return true;
+        }
+        break;
+      }
+
+      case IN_ACK_LENGTH:
+        if (!_readLength(&_inRemaining, &_inMultiplier)) { break; }
+        _ackLength = 0;
+        _inState = _inRemaining ? IN_ACK_BODY : IN_HEADER;
+        break;
+
+      case IN_ACK_BODY:
+      {
+        // MQTT 5 may add a reason code and properties after the packet id
+        uint8_t b = _client->read();
+        if (_ackLength < sizeof(_ack)) { _ack[_ackLength++] = b; }
+        if (--_inRemaining == 0)
+        {
+          _inState = IN_HEADER;
+          if (_ackLength >= 2) { _acknowledge((_ack[0] << 8) | _ack[1]); }
+        }
+        break;
+      }
+
+      case IN_X_LENGTH:
+        if (!_readLength(&_xRemaining, &_inMultiplier)) { break; }
+        _xLength = 0;
+        if ((_xHeader & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_CONNACK)
+        {
+          _inState = IN_X_CONNACK;
+          if (_xRemaining == 0) { _translateConnack(); }
+        }
+        else
+        {
+          _xNeeded = 2;
+          _inState = IN_X_TOPIC;
+        }
+        break;
+
+      case IN_X_CONNACK:
+      {
+        uint8_t b = _client->read();
+        if (_xLength < MQTT_STAGE_SIZE) { _xBuffer[_xLength++] = b; }
+        if (--_xRemaining == 0) { _translateConnack(); }
+        break;
+      }
+
+      case IN_X_TOPIC:
+      {
+        // Topics we can't hold can't be translated, drop the connection rather than corrupt it
+        if (_xRemaining == 0 || _xLength >= MQTT_STAGE_SIZE)
+        {
+          stop();
+          return false;
+        }
+
+        uint8_t b = _client->read();
+        _xRemaining--;
+        _xBuffer[_xLength++] = b;
+        if (_xLength == 2)
+        {
+          _xNeeded = 2 + ((_xBuffer[0] << 8) | b) + ((_xHeader & MQTT_PUBLISH_QOS_MASK) ? 2 : 0);
+        }
+        if (_xLength == _xNeeded)
+        {
+          _xSkip = 0;
+          _inMultiplier = 1;
+          _inState = IN_X_PROPS_LENGTH;
+        }
+        break;
+      }
+
+      case IN_X_PROPS_LENGTH:
+      {
+        if (_xRemaining == 0)
+        {
+          stop();
+          return false;
+        }
+
+        uint8_t b = _client->read();
+        _xRemaining--;
+        _xSkip += (b & 0x7F) * _inMultiplier;
+        _inMultiplier *= 128;
+        if (b & 0x80) { break; }
+
+        if (_xSkip == 0)
+        {
+          _translatePublish();
+        }
+        else
+        {
+          _inState = IN_X_PROPS;
+        }
+        break;
+      }
+
+      case IN_X_PROPS:
+        _client->read();
+        if (_xRemaining > 0) { _xRemaining--; }
+        if (--_xSkip == 0) { _translatePublish(); }
+        break;
+
+      default:
+        // Part way through a packet PubSubClient is reading
+        return true;
+    }
+  }
+
+  return _stagePos < _stageLength || _inState == IN_HEADER || _inState == IN_LENGTH || _inState == IN_BODY;
+}
+
+/*
+ * Read one byte of a remaining length, returns true once it is complete
+ */
+bool HSG_MQTT_CLIENT::_readLength(uint32_t * length, uint32_t * multiplier)
+{
+  uint8_t b = _client->read();
+  *length += (b & 0x7F) * *multiplier;
+  *multiplier *= 128;
+  return !(b & 0x80);
+}
+
+void HSG_MQTT_CLIENT::_translateConnack(void)
+{
+  _inState = IN_HEADER;
+
+  uint8_t flags = (_xLength > 0) ? _xBuffer[0] : 0;
+  _reasonCode = (_xLength > 1) ? _xBuffer[1] : 0x80;
+  _sessionPresent = (flags & 0x01) != 0;
+
+  // A 3.1.1 broker answers a version 5 CONNECT with its own "unacceptable protocol version"
+  if (_reasonCode == MQTT_REASON_UNSUPPORTED_VERSION || _reasonCode == MQTT_RETURN_BAD_PROTOCOL)
+  {
+    _logger->println(F("[mqtt] broker refused mqtt 5, falling back to 3.1.1"));
+    _fallback = true;
+  }
+
+  // The only property we act on is how many topic aliases the broker will take
+  _aliasMax = 0;
+  if (_xLength > 2)
+  {
+    uint32_t propertiesLength = 0;
+    uint32_t multiplier = 1;
+    uint16_t i = 2;
+    uint8_t b;
+    do
+    {
+      b = _xBuffer[i++];
+      propertiesLength += (b & 0x7F) * multiplier;
+      multiplier *= 128;
+    } while ((b & 0x80) && i < _xLength);
+
+    uint16_t end = min((uint32_t)_xLength, i + propertiesLength);
+    while (i < end)
+    {
+      uint8_t id = _xBuffer[i++];
+      if (id == MQTT_PROPERTY_ALIAS_MAXIMUM && i + 2 <= end)
+      {
+        _aliasMax = min((_xBuffer[i] << 8) | _xBuffer[i + 1], MQTT_ALIAS_COUNT);
+      }
+
+      int size = _propertySize(id, &_xBuffer[i], end - i);
+      if (size < 0) { break; }
+      i += size;
+    }
+  }
+
+  // Hand PubSubClient the CONNACK it expects
+  _stage[0] = MQTT_PACKET_CONNACK;
+  _stage[1] = 2;
+  _stage[2] = flags & 0x01;
+  _stage[3] = _mapReasonCode(_reasonCode);
+  _stageLength = 4;
+  _stagePos = 0;
+}
+
+void HSG_MQTT_CLIENT::_translatePublish(void)
+{
+  _inState = IN_HEADER;
+
+  // Topic (and packet id) go out from the stage, the payload straight from the socket
+  _stageLength = _encodeHeader(_stage, _xHeader, _xLength + _xRemaining);
+  memcpy(&_stage[_stageLength], _xBuffer, _xLength);
+  _stageLength += _xLength;
+  _stagePos = 0;
+}
+
+void HSG_MQTT_CLIENT::_trackInbound(uint8_t b)
+{
+  switch (_inState)
+  {
+    case IN_HEADER:
+      _inHeader = b;
+      _inRemaining = 0;
+      _inMultiplier = 1;
+      _inIndex = 0;
+      _inState = IN_LENGTH;
+      return;
+
+    case IN_LENGTH:
+      _inRemaining += (b & 0x7F) * _inMultiplier;
+      _inMultiplier *= 128;
+      if (b & 0x80) { return; }
+      if (_inRemaining > 0)
+      {
+        _inState = IN_BODY;
+        return;
+      }
+      break;
+
+    case IN_BODY:
+      // A 3.1.1 CONNACK passes straight through, note its flags and return code on the way
+      if ((_inHeader & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_CONNACK && _activeVersion < MQTT_VERSION_5)
+      {
+        if (_inIndex == 0) { _sessionPresent = (b & 0x01) != 0; }
+        if (_inIndex == 1) { _reasonCode = b; }
+      }
+      _inIndex++;
+
+      if (--_inRemaining > 0) { return; }
+      break;
+  }
+
+  // Packet complete
+  _inState = IN_HEADER;
+  if ((_inHeader & MQTT_PACKET_TYPE_MASK) == MQTT_PACKET_CONNACK)
+  {
+    _resendAll = true;
+  }
+}
+
+void HSG_MQTT_CLIENT::_acknowledge(uint16_t packetId)
+{
+  for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+  {
+    if (_inflight[i].packetId == packetId)
+    {
+      _inflight[i].packetId = 0;
+      return;
+    }
+  }
+}
+
+uint16_t HSG_MQTT_CLIENT::_nextPacketId(void)
+{
+  // Stay in our own range (which also skips the reserved 0) and skip any id still in flight
+  while (true)
+  {
+    if (++_lastPacketId < MQTT_QOS_PACKET_ID_BASE) { _lastPacketId = MQTT_QOS_PACKET_ID_BASE; }
+
+    bool inUse = false;
+    for (uint8_t i = 0; i < MQTT_QOS_WINDOW; i++)
+    {
+      if (_inflight[i].packetId == _lastPacketId) { inUse = true; }
+    }
+    if (!inUse) { return _lastPacketId; }
+  }
+}
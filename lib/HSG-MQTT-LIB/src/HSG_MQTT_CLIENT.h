@@ -0,0 +1,236 @@
+/*
+ * HSG_MQTT_CLIENT.h
+ *
+ * Network client wrapper which sits between PubSubClient and the socket.
+ * PubSubClient only publishes at QoS 0, so outgoing PUBLISH packets for
+ * selected topics are upgraded to QoS 1 here, held in a small fixed window
+ * until the broker's PUBACK arrives (which is swallowed before PubSubClient
+ * sees it) and retransmitted if it doesn't (on a timer under 3.1.1, only
+ * after a reconnect under MQTT 5).
+ *
+ * It can also speak MQTT 5 on the wire while PubSubClient carries on with
+ * 3.1.1, adding the properties 5 requires (session expiry, topic aliases
+ * for hot topics) on the way out and stripping them (and mapping reason
+ * codes) on the way in. If the broker rejects version 5 the next connect
+ * falls back to 3.1.1. Any Client can be wrapped, so it can be exercised
+ * against a local broker stand-in.
+ *
+ * Outgoing publishes are batched into a single socket write, sent when
+ * full, before any other packet, or by sendBatch() (e.g. at frame end).
+ * A failed socket write drops the connection and fails the next write(),
+ * so PubSubClient sees it even when it happened in a batch.
+ */
+
+#ifndef HSG_MQTT_CLIENT_H
+#define HSG_MQTT_CLIENT_H
+
+#include "Arduino.h"
+#include <Client.h>
+
+// In-flight window, publishes which don't fit in a free slot go out at QoS 0
+#define MQTT_QOS_WINDOW                 8
+#define MQTT_QOS_PACKET_SIZE            1024
+#define MQTT_QOS_RETRY_MS               5000       // 3.1.1 only
+#define MQTT_QOS_PREFIX_SIZE            96
+
+// Upgraded publishes take ids from the top half, PubSubClient numbers its
+// SUBSCRIBE/UNSUBSCRIBE packets up from 1 so the two never share an id
+#define MQTT_QOS_PACKET_ID_BASE         0x8000
+
+// Protocol levels
+#define MQTT_VERSION_3_1_1              4
+#define MQTT_VERSION_5                  5
+
+// Topic aliases for hot topics (MQTT 5 only, capped by the broker's Topic Alias Maximum)
+#define MQTT_ALIAS_COUNT                4
+
+// Publishes batched per socket write, about one TCP segment
+#define MQTT_BATCH_SIZE                 1460
+
+// Largest topic (plus packet id) of an incoming PUBLISH we can strip properties from
+#define MQTT_STAGE_SIZE                 256
+
+// Control packet types (upper nibble of the fixed header)
+#define MQTT_PACKET_TYPE_MASK           0xF0
+#define MQTT_PACKET_CONNECT             0x10
+#define MQTT_PACKET_CONNACK             0x20
+#define MQTT_PACKET_PUBLISH             0x30
+#define MQTT_PACKET_PUBACK              0x40
+#define MQTT_PACKET_SUBSCRIBE           0x80
+#define MQTT_PACKET_UNSUBSCRIBE         0xA0
+
+// CONNECT flags
+#define MQTT_CONNECT_WILL               0x04
+
+// MQTT 5 properties we use
+#define MQTT_PROPERTY_SESSION_EXPIRY    0x11
+#define MQTT_PROPERTY_ALIAS_MAXIMUM     0x22
+#define MQTT_PROPERTY_TOPIC_ALIAS       0x23
+
+// MQTT 5 CONNACK reason codes (and the 3.1.1 return code) meaning the protocol version was refused
+#define MQTT_REASON_UNSUPPORTED_VERSION 0x84
+#define MQTT_RETURN_BAD_PROTOCOL        0x01
+
+// PUBLISH flags (lower nibble)
+#define MQTT_PUBLISH_DUP                0x08
+#define MQTT_PUBLISH_QOS_MASK           0x06
+#define MQTT_PUBLISH_QOS1               0x02
+
+// Largest fixed header (type byte plus a 4 byte remaining length)
+#define MQTT_MAX_FIXED_HEADER           5
+
+struct MqttInflight
+{
+  uint16_t packetId;                      // 0 if the slot is free
+  uint16_t length;
+  uint32_t sentMs;
+  uint8_t  packet[MQTT_QOS_PACKET_SIZE];
+};
+
+class HSG_MQTT_CLIENT : public Client
+{
+  public:
+    HSG_MQTT_CLIENT(Client& client);
+
+    // Where to log connection problems, Serial until set
+    void setLogger(Print * logger);
+
+    // Publishes to topics starting with this prefix are sent at QoS 1, NULL disables
+    void setQosPrefix(const char * prefix);
+
+    // Protocol to try on the next connect (MQTT_VERSION_5 falls back to 3.1.1 if refused)
+    void setProtocolVersion(uint8_t version);
+    uint8_t getProtocolVersion(void);
+
+    // MQTT 5 session expiry sent with CONNECT (0 ends the session on disconnect)
+    void setSessionExpiry(uint32_t seconds);
+
+    // Topics worth a topic alias (MQTT 5 only), returns false once all are taken
+    bool addAliasTopic(const char * topic);
+    void clearAliasTopics(void);
+
+    // Result of the last CONNACK, reason code as sent by the broker
+    uint8_t getReasonCode(void);
+    bool isSessionPresent(void);
+
+    // Retransmits anything unacknowledged and sends the batch, call regularly
+    void loop(void);
+
+    // Write any batched publishes to the socket now
+    void sendBatch(void);
+
+    uint8_t getInflightCount(void);
+    uint32_t getRetransmitCount(void);
+    uint32_t getOverflowCount(void);
+    uint32_t getBatchCount(void);
+
+    // Client interface
+    int connect(IPAddress ip, uint16_t port);
+    int connect(const char * host, uint16_t port);
+    size_t write(uint8_t b);
+    size_t write(const uint8_t * buf, size_t size);
+    int available(void);
+    int read(void);
+    int read(uint8_t * buf, size_t size);
+    int peek(void);
+    void flush(void);
+    void stop(void);
+    uint8_t connected(void);
+    operator bool(void);
+
+  private:
+    Client* _client;
+    Print* _logger = &Serial;
+
+    char _qosPrefix[MQTT_QOS_PREFIX_SIZE];
+
+    MqttInflight _inflight[MQTT_QOS_WINDOW];
+    uint16_t _lastPacketId = 0;
+    bool _resendAll = false;
+
+    uint32_t _retransmits = 0;
+    uint32_t _overflows = 0;
+
+    uint8_t _version = MQTT_VERSION_3_1_1;
+    uint8_t _activeVersion = MQTT_VERSION_3_1_1;
+    bool _fallback = false;
+    uint32_t _sessionExpiry = 0;
+
+    char _aliasTopics[MQTT_ALIAS_COUNT][MQTT_QOS_PREFIX_SIZE];
+    uint8_t _aliasCount = 0;
+    uint8_t _aliasMax = 0;
+    uint8_t _aliasSent = 0;                   // bitmask of aliases set up this connection
+
+    uint8_t _reasonCode = 0;
+    bool _sessionPresent = false;
+
+    // Outgoing packet being assembled from PubSubClient's writes
+    uint8_t _outState;
+    uint8_t _outPacket[MQTT_QOS_PACKET_SIZE];
+    uint32_t _outLength;
+    uint32_t _outBodyLength;
+    uint32_t _outRemaining;
+    uint32_t _outMultiplier;
+
+    // Oversized MQTT 5 publishes streamed through still need a property length after the topic
+    bool _passInsert;
+    uint32_t _passOffset;
+    uint32_t _passInsertAt;
+
+    // Translated packets on their way out
+    uint8_t _txPacket[MQTT_QOS_PACKET_SIZE + 16];
+
+    // Publishes waiting to be written together
+    uint8_t _batch[MQTT_BATCH_SIZE];
+    uint16_t _batchLength;
+    uint32_t _batchWrites = 0;
+
+    // A socket write came up short, reported by write() until the next connect
+    bool _writeFailed = false;
+
+    // Framing of the incoming packet PubSubClient is reading
+    uint8_t _inState;
+    uint8_t _inHeader;
+    uint32_t _inRemaining;
+    uint32_t _inMultiplier;
+    uint32_t _inIndex;
+    uint8_t _ack[4];
+    uint8_t _ackLength;
+
+    // Incoming MQTT 5 CONNACK/PUBLISH being translated, then handed over from the stage
+    uint8_t _xHeader;
+    uint32_t _xRemaining;                 // bytes of the original packet still to read
+    uint32_t _xSkip;                      // property bytes still to discard
+    uint32_t _xNeeded;                    // topic length field, topic and packet id
+    uint8_t _xBuffer[MQTT_STAGE_SIZE];
+    uint16_t _xLength;
+    uint8_t _stage[MQTT_STAGE_SIZE + MQTT_MAX_FIXED_HEADER];
+    uint16_t _stageLength;
+    uint16_t _stagePos;
+
+    void _reset(void);
+
+    void _packetOut(void);
+    bool _publishQos1(void);
+    void _transmit(const uint8_t * packet, uint32_t length);
+    void _transmitConnect(uint8_t header, const uint8_t * body, uint32_t bodyLength);
+    void _transmitPublish(uint8_t header, const uint8_t * body, uint32_t bodyLength);
+    void _transmitInsert(uint8_t header, const uint8_t * body, uint32_t bodyLength, uint32_t offset);
+    void _queue(const uint8_t * buf, size_t size);
+    void _send(const uint8_t * buf, size_t size);
+    void _write(const uint8_t * buf, size_t size);
+    void _passOut(const uint8_t * buf, size_t size);
+
+    int _findAlias(const uint8_t * topic, uint16_t topicLength);
+
+    bool _pump(void);
+    bool _readLength(uint32_t * length, uint32_t * multiplier);
+    void _translateConnack(void);
+    void _translatePublish(void);
+    void _trackInbound(uint8_t b);
+    void _acknowledge(uint16_t packetId);
+
+    uint16_t _nextPacketId(void);
+};
+
+#endif
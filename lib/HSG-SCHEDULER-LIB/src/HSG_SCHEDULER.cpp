@@ -0,0 +1,540 @@
+/*
+ * HSG_SCHEDULER.cpp
+ */
+
+#include "HSG_SCHEDULER.h"
+
+#include <HSG_HEAP.h>
+
+// Working document size for a single timer (the payload plus persistence fields)
+#define SCHEDULER_DOC_SIZE        512
+#define SCHEDULER_LINE_SIZE       (SCHEDULER_PAYLOAD_SIZE + 96)
+
+void HSG_SCHEDULER::begin(schedulerCallback callback)
+{
+  _callback = callback;
+
+  for (uint16_t i = 0; i < SCHEDULER_LIST_COUNT; i++)
+  {
+    _heads[i] = SCHEDULER_NONE;
+  }
+
+  // Chain the whole pool onto the free list
+  _free = SCHEDULER_NONE;
+  for (uint16_t id = SCHEDULER_MAX_TIMERS; id > 0; id--)
+  {
+    _timers[id - 1].list = SCHEDULER_NONE;
+    _timers[id - 1].payload = NULL;
+    _timers[id - 1].next = _free;
+    _free = id - 1;
+  }
+  _count = 0;
+
+  _lastTickMs = _lastMillis = millis();
+
+  _load();
+}
+
+void HSG_SCHEDULER::loop()
+{
+  // Catch up on every tick we missed, a late tick still fires its timers
+  while ((millis() - _lastTickMs) >= SCHEDULER_TICK_MS)
+  {
+    _lastTickMs += SCHEDULER_TICK_MS;
+    _advance();
+  }
+
+  // Write a few lines at a time while saving, so a full pool never stalls a frame
+  if (_saveId != SCHEDULER_NONE)
+  {
+    _continueSave();
+  }
+  else if (_dirty && (millis() - _dirtyMs) >= SCHEDULER_SAVE_DELAY_MS)
+  {
+    _dirty = false;
+    _startSave();
+  }
+}
+
+void HSG_SCHEDULER::setLogger(Print * logger)
+{
+  _logger = logger;
+}
+
+void HSG_SCHEDULER::cmnd(JsonVariant json)
+{
+  if (json.containsKey("time"))
+  {
+    setTime(json["time"].as<uint64_t>());
+  }
+
+  if (json.containsKey("cancelTimer"))
+  {
+    cancel(json["cancelTimer"]);
+  }
+}
+
+bool HSG_SCHEDULER::defer(JsonVariant json)
+{
+  if (!json.containsKey("after") && !json.containsKey("at")) { return false; }
+
+  // Store the command without the scheduling fields so it runs as-is when due
+  TrackedJsonDocument<HEAP_TAG_COMMAND> command(SCHEDULER_DOC_SIZE);
+  command.set(json);
+  command.remove("after");
+  command.remove("at");
+  command.remove("timer");
+
+  const char * name = json["timer"];
+  if (json.containsKey("at"))
+  {
+    scheduleAt(command.as<JsonVariant>(), json["at"].as<uint64_t>(), name);
+  }
+  else
+  {
+    schedule(command.as<JsonVariant>(), json["after"].as<uint64_t>(), name);
+  }
+
+  return true;
+}
+
+bool HSG_SCHEDULER::schedule(JsonVariant command, uint64_t delayMs, const char * name)
+{
+  uint16_t id = _allocate(command, name);
+  if (id == SCHEDULER_NONE) { return false; }
+
+  _timers[id].expires = _tick + _ticksFor(delayMs);
+  _insert(id);
+
+  if (_isWorthSaving(id)) { _markDirty(); }
+  return true;
+}
+
+bool HSG_SCHEDULER::scheduleAt(JsonVariant command, uint64_t epochMs, const char * name)
+{
+  uint16_t id = _allocate(command, name);
+  if (id == SCHEDULER_NONE) { return false; }
+
+  _timers[id].epochMs = epochMs;
+
+  if (isTimeSet())
+  {
+    uint64_t now = getTime();
+    _timers[id].expires = _tick + _ticksFor(epochMs > now ? epochMs - now : 0);
+    _insert(id);
+  }
+  else
+  {
+    // Held back until the clock is synced
+    _link(id, SCHEDULER_LIST_WAITING);
+  }
+
+  if (_isWorthSaving(id)) { _markDirty(); }
+  return true;
+}
+
+bool HSG_SCHEDULER::cancel(const char * name)
+{
+  if (name == NULL || name[0] == '\0') { return false; }
+
+  for (uint16_t id = 0; id < SCHEDULER_MAX_TIMERS; id++)
+  {
+    if (_timers[id].list != SCHEDULER_NONE && strcmp(_timers[id].name, name) == 0)
+    {
+      _release(id);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+void HSG_SCHEDULER::setTime(uint64_t epochMs)
+{
+  getTime();
+  _epochOffset = epochMs - _uptimeMs;
+
+  // File any timers which were waiting for the clock
+  uint16_t id = _heads[SCHEDULER_LIST_WAITING];
+  _heads[SCHEDULER_LIST_WAITING] = SCHEDULER_NONE;
+
+  while (id != SCHEDULER_NONE)
+  {
+    uint16_t next = _timers[id].next;
+    uint64_t dueMs = _timers[id].epochMs;
+    _timers[id].expires = _tick + _ticksFor(dueMs > epochMs ? dueMs - epochMs : 0);
+    _insert(id);
+    id = next;
+  }
+}
+
+bool HSG_SCHEDULER::isTimeSet(void)
+{
+  return _epochOffset != 0;
+}
+
+uint64_t HSG_SCHEDULER::getTime(void)
+{
+  // Extend millis() to 64 bits so the clock survives the 49 day wrap
+  uint32_t now = millis();
+  _uptimeMs += (uint32_t)(now - _lastMillis);
+  _lastMillis = now;
+
+  return _uptimeMs + _epochOffset;
+}
+
+uint16_t HSG_SCHEDULER::getCount(void)
+{
+  return _count;
+}
+
+uint64_t HSG_SCHEDULER::getFiringTime(void)
+{
+  return _firingEpochMs;
+}
+
+uint16_t HSG_SCHEDULER::_allocate(JsonVariant command, const char * name)
+{
+  size_t length = measureJson(command);
+  if (length >= SCHEDULER_PAYLOAD_SIZE)
+  {
+    _logger->println(F("[sched] command too large to schedule"));
+    return SCHEDULER_NONE;
+  }
+
+  char * payload = (char *)HSG_HEAP::allocate(HEAP_TAG_COMMAND, length + 1);
+  if (payload == NULL)
+  {
+    _logger->println(F("[sched] out of memory, command dropped"));
+    return SCHEDULER_NONE;
+  }
+
+  // A named timer replaces any pending timer with the same name, only once
+  // nothing else can fail (other than a full pool, which replacing never hits)
+  cancel(name);
+
+  if (_free == SCHEDULER_NONE)
+  {
+    HSG_HEAP::deallocate(payload);
+    _logger->println(F("[sched] timer pool full, command dropped"));
+    return SCHEDULER_NONE;
+  }
+
+  uint16_t id = _free;
+  SchedulerTimer * timer = &_timers[id];
+  _free = timer->next;
+
+  serializeJson(command, payload, length + 1);
+  timer->payload = payload;
+  strncpy(timer->name, name ? name : "", SCHEDULER_NAME_SIZE - 1);
+  timer->name[SCHEDULER_NAME_SIZE - 1] = '\0';
+  timer->epochMs = 0;
+  timer->saved = false;
+
+  _count++;
+  return id;
+}
+
+void HSG_SCHEDULER::_release(uint16_t id)
+{
+  _unlink(id);
+
+  _timers[id].list = SCHEDULER_NONE;
+  _timers[id].next = _free;
+  _free = id;
+
+  HSG_HEAP::deallocate(_timers[id].payload);
+  _timers[id].payload = NULL;
+
+  _count--;
+
+  // Only the file needs updating, and only if this timer made it in there
+  if (_timers[id].saved) { _markDirty(); }
+}
+
+void HSG_SCHEDULER::_link(uint16_t id, uint16_t list)
+{
+  SchedulerTimer * timer = &_timers[id];
+  timer->list = list;
+  timer->prev = SCHEDULER_NONE;
+  timer->next = _heads[list];
+
+  if (timer->next != SCHEDULER_NONE)
+  {
+    _timers[timer->next].prev = id;
+  }
+  _heads[list] = id;
+}
+
+void HSG_SCHEDULER::_unlink(uint16_t id)
+{
+  SchedulerTimer * timer = &_timers[id];
+
+  if (timer->prev != SCHEDULER_NONE)
+  {
+    _timers[timer->prev].next = timer->next;
+  }
+  else
+  {
+    _heads[timer->list] = timer->next;
+  }
+
+  if (timer->next != SCHEDULER_NONE)
+  {
+    _timers[timer->next].prev = timer->prev;
+  }
+}
+
+/*
+ * File a timer in the lowest wheel level whose span covers its delay
+ */
+void HSG_SCHEDULER::_insert(uint16_t id)
+{
+  uint32_t expires = _timers[id].expires;
+  uint32_t delta = expires - _tick;
+
+  // Overdue timers (only possible when cascading) go in this tick's slot
+  if ((int32_t)delta < 0)
+  {
+    expires = _tick;
+    delta = 0;
+  }
+
+  // Beyond the top level, park in its furthest slot and re-file when that cascades
+  if (delta >= (1UL << (SCHEDULER_SLOT_BITS * SCHEDULER_LEVELS)))
+  {
+    expires = _tick + (1UL << (SCHEDULER_SLOT_BITS * SCHEDULER_LEVELS)) - 1;
+  }
+
+  uint8_t level = 0;
+  while (level < (SCHEDULER_LEVELS - 1) && delta >= (1UL << (SCHEDULER_SLOT_BITS * (level + 1))))
+  {
+    level++;
+  }
+
+  uint16_t slot = (expires >> (SCHEDULER_SLOT_BITS * level)) & SCHEDULER_SLOT_MASK;
+  _link(id, (level * SCHEDULER_SLOTS) + slot);
+}
+
+/*
+ * Re-file every timer in a higher level slot, each moves down at least one level
+ */
+void HSG_SCHEDULER::_cascade(uint16_t list)
+{
+  uint16_t id = _heads[list];
+  _heads[list] = SCHEDULER_NONE;
+
+  while (id != SCHEDULER_NONE)
+  {
+    uint16_t next = _timers[id].next;
+    _insert(id);
+    id = next;
+  }
+}
+
+void HSG_SCHEDULER::_advance(void)
+{
+  _tick++;
+
+  // Each time a level wraps, pull the next slot of the level above down
+  for (uint8_t level = 1; level < SCHEDULER_LEVELS; level++)
+  {
+    if (_tick & ((1UL << (SCHEDULER_SLOT_BITS * level)) - 1)) { break; }
+    _cascade((level * SCHEDULER_SLOTS) + ((_tick >> (SCHEDULER_SLOT_BITS * level)) & SCHEDULER_SLOT_MASK));
+  }
+
+  uint16_t slot = _tick & SCHEDULER_SLOT_MASK;
+  if (_heads[slot] == SCHEDULER_NONE) { return; }
+
+  // Move the due timers aside so callbacks can schedule or cancel timers freely
+  _heads[SCHEDULER_LIST_FIRING] = _heads[slot];
+  _heads[slot] = SCHEDULER_NONE;
+  for (uint16_t id = _heads[SCHEDULER_LIST_FIRING]; id != SCHEDULER_NONE; id = _timers[id].next)
+  {
+    _timers[id].list = SCHEDULER_LIST_FIRING;
+  }
+
+  while (_heads[SCHEDULER_LIST_FIRING] != SCHEDULER_NONE)
+  {
+    _fire(_heads[SCHEDULER_LIST_FIRING]);
+  }
+}
+
+void HSG_SCHEDULER::_fire(uint16_t id)
+{
+  TrackedJsonDocument<HEAP_TAG_COMMAND> command(SCHEDULER_DOC_SIZE);
+  DeserializationError error = deserializeJson(command, (const char *)_timers[id].payload);
+  uint64_t epochMs = _timers[id].epochMs;
+
+  // Free the slot first so the command can re-use the timer name
+  _release(id);
+
+  if (!error && _callback)
+  {
+    _firingEpochMs = epochMs;
+    _callback(command.as<JsonVariant>());
+    _firingEpochMs = 0;
+  }
+}
+
+uint32_t HSG_SCHEDULER::_ticksFor(uint64_t delayMs)
+{
+  // Beyond the wheel's range (or a corrupt saved delay) and the sums below could wrap
+  if (delayMs >= (uint64_t)0x7FFFFFFF * SCHEDULER_TICK_MS) { return 0x7FFFFFFF; }
+
+  // Count from the last tick, which may be up to a tick behind, so timers never fire early
+  delayMs += millis() - _lastTickMs;
+  uint64_t ticks = (delayMs + SCHEDULER_TICK_MS - 1) / SCHEDULER_TICK_MS;
+
+  // Never file in the current slot, it has already been processed
+  if (ticks == 0) { return 1; }
+  if (ticks > 0x7FFFFFFF) { return 0x7FFFFFFF; }
+  return ticks;
+}
+
+void HSG_SCHEDULER::_markDirty(void)
+{
+  _dirty = true;
+  _dirtyMs = millis();
+}
+
+/*
+ * Timers due before the next save could happen would only be written to
+ * flash to be removed again, so they are left out
+ */
+bool HSG_SCHEDULER::_isWorthSaving(uint16_t id)
+{
+  SchedulerTimer * timer = &_timers[id];
+  if (timer->list == SCHEDULER_NONE || timer->list == SCHEDULER_LIST_FIRING) { return false; }
+
+  // Waiting for the clock to be synced, so may be a while yet
+  if (timer->list == SCHEDULER_LIST_WAITING) { return true; }
+
+  return (uint64_t)(timer->expires - _tick) * SCHEDULER_TICK_MS > SCHEDULER_SAVE_DELAY_MS;
+}
+
+/*
+ * Write one line per pending timer to a temporary file, relative timers
+ * store the time remaining
+ */
+void HSG_SCHEDULER::_startSave(void)
+{
+  // Nothing left worth keeping (a save in progress is simply restarted)
+  bool any = false;
+  for (uint16_t id = 0; id < SCHEDULER_MAX_TIMERS && !any; id++)
+  {
+    any = _isWorthSaving(id);
+  }
+
+  if (!any)
+  {
+    LittleFS.remove(SCHEDULER_FILENAME);
+    for (uint16_t id = 0; id < SCHEDULER_MAX_TIMERS; id++)
+    {
+      _timers[id].saved = false;
+    }
+    return;
+  }
+
+  // Try again later if the file system is busy or full
+  _saveFile = LittleFS.open(SCHEDULER_TEMP_FILENAME, "w");
+  if (!_saveFile)
+  {
+    _markDirty();
+    return;
+  }
+
+  _saveId = 0;
+}
+
+void HSG_SCHEDULER::_continueSave(void)
+{
+  TrackedJsonDocument<HEAP_TAG_COMMAND> json(SCHEDULER_DOC_SIZE);
+
+  uint8_t lines = 0;
+  while (_saveId < SCHEDULER_MAX_TIMERS && lines < SCHEDULER_SAVE_LINES)
+  {
+    uint16_t id = _saveId++;
+    SchedulerTimer * timer = &_timers[id];
+    if (!_isWorthSaving(id))
+    {
+      // Anything free or about to fire won't be in the new file
+      timer->saved = false;
+      continue;
+    }
+
+    json.clear();
+    if (timer->epochMs)
+    {
+      json["at"] = timer->epochMs;
+    }
+    else
+    {
+      json["in"] = (uint64_t)(timer->expires - _tick) * SCHEDULER_TICK_MS;
+    }
+
+    if (timer->name[0])
+    {
+      json["name"] = (const char *)timer->name;
+    }
+
+    json["cmd"] = serialized((const char *)timer->payload);
+    serializeJson(json, _saveFile);
+    _saveFile.print('\n');
+
+    timer->saved = true;
+    lines++;
+  }
+
+  if (_saveId < SCHEDULER_MAX_TIMERS) { return; }
+
+  // Complete, swap it in so a reset part way through never leaves a truncated file
+  _saveFile.close();
+  _saveId = SCHEDULER_NONE;
+  LittleFS.remove(SCHEDULER_FILENAME);
+  LittleFS.rename(SCHEDULER_TEMP_FILENAME, SCHEDULER_FILENAME);
+}
+
+/*
+ * Restore persisted timers, relative timers lose any time spent powered off
+ */
+void HSG_SCHEDULER::_load(void)
+{
+  File file = LittleFS.open(SCHEDULER_FILENAME, "r");
+  if (!file) { return; }
+
+  char line[SCHEDULER_LINE_SIZE];
+  TrackedJsonDocument<HEAP_TAG_COMMAND> json(SCHEDULER_DOC_SIZE);
+
+  while (file.available())
+  {
+    size_t length = file.readBytesUntil('\n', line, sizeof(line) - 1);
+    line[length] = '\0';
+    if (length == 0) { continue; }
+
+    if (deserializeJson(json, (const char *)line)) { continue; }
+
+    if (json.containsKey("at"))
+    {
+      scheduleAt(json["cmd"], json["at"].as<uint64_t>(), json["name"]);
+    }
+    else
+    {
+      // Stored as 64-bit ms, anything beyond the wheel's range is clamped when filed
+      schedule(json["cmd"], json["in"] | (uint64_t)0, json["name"]);
+    }
+  }
+
+  file.close();
+
+  _logger->print(F("[sched] restored "));
+  _logger->print(_count);
+  _logger->println(F(" timers"));
+
+  // Nothing has changed since the file was written, and all of it is in there
+  for (uint16_t id = 0; id < SCHEDULER_MAX_TIMERS; id++)
+  {
+    if (_timers[id].list != SCHEDULER_NONE) { _timers[id].saved = true; }
+  }
+  _dirty = false;
+}
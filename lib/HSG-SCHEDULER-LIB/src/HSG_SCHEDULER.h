@@ -0,0 +1,136 @@
+/*
+ * HSG_SCHEDULER.h
+ *
+ * Runs commands after a delay or at an absolute (synced) time. Pending
+ * timers live in a fixed pool and are filed in a hierarchical timing wheel,
+ * so each tick costs the same however many timers are waiting. Commands
+ * are only allocated while their timer is pending, so an idle pool is small.
+ */
+
+#ifndef HSG_SCHEDULER_H
+#define HSG_SCHEDULER_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <LittleFS.h>
+
+// Wheel resolution, matches the render frame
+#define SCHEDULER_TICK_MS         10
+
+// 4 levels of 64 slots covers 64^4 ticks (~46 hours), later timers are re-filed as the wheel turns
+#define SCHEDULER_LEVELS          4
+#define SCHEDULER_SLOT_BITS       6
+#define SCHEDULER_SLOTS           (1 << SCHEDULER_SLOT_BITS)
+#define SCHEDULER_SLOT_MASK       (SCHEDULER_SLOTS - 1)
+
+// Timer pool, the payload size is the largest command that can be scheduled
+#define SCHEDULER_MAX_TIMERS      256
+#define SCHEDULER_PAYLOAD_SIZE    128
+#define SCHEDULER_NAME_SIZE       16
+#define SCHEDULER_NONE            0xFFFF
+
+// Pending timers are persisted a little after the last change to save flash wear, timers
+// due sooner than that are never written. Saves are spread over a few lines per loop so
+// they don't hold up a frame, and swapped in once complete
+#define SCHEDULER_FILENAME        "/timers.json"
+#define SCHEDULER_TEMP_FILENAME   "/timers.tmp"
+#define SCHEDULER_SAVE_DELAY_MS   5000
+#define SCHEDULER_SAVE_LINES      8
+
+// Timer lists, the wheel slots come first
+#define SCHEDULER_LIST_WAITING    (SCHEDULER_LEVELS * SCHEDULER_SLOTS)
+#define SCHEDULER_LIST_FIRING     (SCHEDULER_LIST_WAITING + 1)
+#define SCHEDULER_LIST_COUNT      (SCHEDULER_LIST_FIRING + 1)
+
+// Callback type for due commands
+typedef void (* schedulerCallback)(JsonVariant);
+
+struct SchedulerTimer
+{
+  uint32_t expires;                       // wheel tick the timer is due
+  uint64_t epochMs;                       // absolute due time, 0 for relative timers
+  uint16_t next;
+  uint16_t prev;
+  uint16_t list;                          // list the timer is on, SCHEDULER_NONE if free
+  bool     saved;                         // written to flash, so firing or cancelling needs a save
+  char     name[SCHEDULER_NAME_SIZE];     // optional, re-using a name replaces the timer
+  char *   payload;                       // serialised command, allocated while pending
+};
+
+class HSG_SCHEDULER
+{
+public:
+  // Restores any persisted timers, so call once the file system is mounted
+  void begin(schedulerCallback callback);
+  void loop();
+
+  // Where to log, Serial until set
+  void setLogger(Print * logger);
+
+  // Handles {"time": epochMs} clock sync and {"cancelTimer": "name"}
+  void cmnd(JsonVariant json);
+
+  // Queues a command carrying "after" (ms) or "at" (epoch ms), returns false if it should run now
+  bool defer(JsonVariant json);
+
+  bool schedule(JsonVariant command, uint64_t delayMs, const char * name);
+  bool scheduleAt(JsonVariant command, uint64_t epochMs, const char * name);
+  bool cancel(const char * name);
+
+  // Wall clock, set over MQTT
+  void setTime(uint64_t epochMs);
+  bool isTimeSet(void);
+  uint64_t getTime(void);
+
+  uint16_t getCount(void);
+
+  // Due time (epoch ms) of the "at" timer whose command is running, 0 otherwise
+  uint64_t getFiringTime(void);
+
+private:
+  schedulerCallback _callback;
+  Print * _logger = &Serial;
+
+  SchedulerTimer _timers[SCHEDULER_MAX_TIMERS];
+  uint16_t _heads[SCHEDULER_LIST_COUNT];
+  uint16_t _free = SCHEDULER_NONE;
+  uint16_t _count = 0;
+
+  uint32_t _tick = 0;
+  uint32_t _lastTickMs;
+
+  // Offset from our 64-bit uptime to epoch ms, 0 until synced
+  uint64_t _uptimeMs = 0;
+  uint32_t _lastMillis;
+  uint64_t _epochOffset = 0;
+
+  uint64_t _firingEpochMs = 0;
+
+  bool _dirty = false;
+  uint32_t _dirtyMs;
+
+  // Save in progress, the next timer to write
+  File _saveFile;
+  uint16_t _saveId = SCHEDULER_NONE;
+
+  uint16_t _allocate(JsonVariant command, const char * name);
+  void _release(uint16_t id);
+
+  void _link(uint16_t id, uint16_t list);
+  void _unlink(uint16_t id);
+
+  void _insert(uint16_t id);
+  void _cascade(uint16_t list);
+  void _advance(void);
+  void _fire(uint16_t id);
+
+  uint32_t _ticksFor(uint64_t delayMs);
+
+  void _markDirty(void);
+  bool _isWorthSaving(uint16_t id);
+  void _startSave(void);
+  void _continueSave(void);
+  void _load(void);
+};
+
+#endif
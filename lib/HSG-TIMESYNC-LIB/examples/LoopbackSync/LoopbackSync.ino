@@ -0,0 +1,268 @@
+/*
+ * LoopbackSync.ino
+ *
+ * Runs a leader and two followers in one sketch, talking over an in-memory
+ * UDP bus rather than the network. The followers are started a few seconds
+ * after the leader (so their clocks are that far behind) and run fast and
+ * slow, they should step onto the leader's timebase, report that step via
+ * takeStepMs(), then track it to well within a millisecond.
+ */
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <HSG_TIMESYNC.h>
+
+#define NODES                 3
+#define QUEUE_SIZE            8
+
+#define SYNC_INTERVAL_MS      250
+#define REPORT_MS             5000
+#define RUN_MS                60000
+
+// Followers must agree with the leader to within this at the end of the run
+#define PASS_ERROR_US         1000
+#define PASS_STEP_MS          50
+
+/*
+ * In-memory UDP bus, each endpoint has its own address and packets sent to
+ * the multicast group are delivered to every endpoint that joined it
+ */
+struct LoopbackPacket
+{
+  IPAddress ip;
+  uint16_t port;
+  uint16_t length;
+  uint8_t data[sizeof(TimeSyncPacket)];
+};
+
+class LoopbackUdp;
+LoopbackUdp * bus[NODES];
+
+class LoopbackUdp : public UDP
+{
+public:
+  IPAddress ip;
+
+  uint8_t begin(uint16_t port) { _port = port; return 1; }
+  uint8_t beginMulticast(IPAddress group, uint16_t port) { _group = group; _joined = true; return begin(port); }
+  void stop() { _joined = false; _queueCount = 0; }
+
+  int beginPacket(IPAddress ip, uint16_t port) { _toIp = ip; _toPort = port; _out.length = 0; return 1; }
+  int beginPacket(const char * host, uint16_t port) { IPAddress ip; return ip.fromString(host) ? beginPacket(ip, port) : 0; }
+  int endPacket();
+
+  size_t write(uint8_t data) { return write(&data, 1); }
+  size_t write(const uint8_t * buffer, size_t size)
+  {
+    size = min(size, sizeof(_out.data) - _out.length);
+    memcpy(&_out.data[_out.length], buffer, size);
+    _out.length += size;
+    return size;
+  }
+
+  int parsePacket()
+  {
+    if (_queueCount == 0) { return 0; }
+
+    _in = _queue[_queueHead];
+    _queueHead = (_queueHead + 1) % QUEUE_SIZE;
+    _queueCount--;
+    _inPos = 0;
+    return _in.length;
+  }
+
+  int available() { return _in.length - _inPos; }
+  int read() { return available() ? _in.data[_inPos++] : -1; }
+  int read(unsigned char * buffer, size_t len)
+  {
+    len = min(len, (size_t)available());
+    memcpy(buffer, &_in.data[_inPos], len);
+    _inPos += len;
+    return len;
+  }
+  int read(char * buffer, size_t len) { return read((unsigned char *)buffer, len); }
+  int peek() { return available() ? _in.data[_inPos] : -1; }
+  void flush() { _inPos = _in.length; }
+
+  IPAddress remoteIP() { return _in.ip; }
+  uint16_t remotePort() { return _in.port; }
+
+  void deliver(LoopbackPacket * packet)
+  {
+    // Like a real socket, anything that doesn't fit is dropped
+    if (_queueCount == QUEUE_SIZE) { return; }
+
+    _queue[(_queueHead + _queueCount) % QUEUE_SIZE] = *packet;
+    _queueCount++;
+  }
+
+  bool accepts(IPAddress ip, uint16_t port)
+  {
+    return port == _port && (ip == this->ip || (_joined && ip == _group));
+  }
+
+private:
+  uint16_t _port = 0;
+  IPAddress _group;
+  bool _joined = false;
+
+  IPAddress _toIp;
+  uint16_t _toPort = 0;
+  LoopbackPacket _out;
+
+  LoopbackPacket _queue[QUEUE_SIZE];
+  uint8_t _queueHead = 0;
+  uint8_t _queueCount = 0;
+
+  LoopbackPacket _in;
+  uint16_t _inPos = 0;
+};
+
+int LoopbackUdp::endPacket()
+{
+  _out.ip = ip;
+  _out.port = _port;
+
+  // Multicast loops back to the sender as well, the same as on the network
+  for (uint8_t i = 0; i < NODES; i++)
+  {
+    if (bus[i]->accepts(_toIp, _toPort)) { bus[i]->deliver(&_out); }
+  }
+  return 1;
+}
+
+/*
+ * Time sync running on a clock that gains (or loses) ppm on micros()
+ */
+class SkewedTimeSync : public HSG_TIMESYNC
+{
+public:
+  SkewedTimeSync(int32_t ppm) : _ppm(ppm) {}
+
+protected:
+  uint32_t _localMicros(void)
+  {
+    uint32_t micros32 = micros();
+    uint32_t elapsed = micros32 - _lastMicros;
+    _lastMicros = micros32;
+
+    // Carry the fraction so the skew is exact over any number of calls
+    _skew += (int64_t)elapsed * _ppm;
+    int32_t extra = _skew / 1000000;
+    _skew -= (int64_t)extra * 1000000;
+
+    _clockUs += elapsed + extra;
+    return _clockUs;
+  }
+
+private:
+  int32_t _ppm;
+  uint32_t _lastMicros = micros();
+  int64_t _skew = 0;
+  uint32_t _clockUs = 0;
+};
+
+// Node 0 leads, the others join late with fast and slow clocks
+SkewedTimeSync nodes[NODES] = { SkewedTimeSync(0), SkewedTimeSync(150), SkewedTimeSync(-80) };
+LoopbackUdp udp[NODES];
+const uint32_t START_MS[NODES] = { 0, 2000, 7000 };
+
+bool started[NODES];
+long stepMs[NODES];
+uint32_t lastReport = 0;
+bool finished = false;
+
+void startNode(uint8_t i)
+{
+  nodes[i].begin(&udp[i]);
+
+  StaticJsonDocument<128> config;
+  config["timeSync"]["leader"] = (i == 0);
+  config["timeSync"]["intervalMs"] = SYNC_INTERVAL_MS;
+  config["timeSync"]["updateSeconds"] = 0;
+  nodes[i].conf(config.as<JsonVariant>());
+
+  started[i] = true;
+}
+
+long errorUs(uint8_t i)
+{
+  return (long)(int64_t)(nodes[i].getMicros() - nodes[0].getMicros());
+}
+
+void report()
+{
+  Serial.print(F("t="));
+  Serial.print(millis() / 1000);
+  Serial.print(F("s"));
+
+  for (uint8_t i = 1; i < NODES; i++)
+  {
+    if (!started[i]) { continue; }
+
+    Serial.print(F("  node"));
+    Serial.print(i);
+    Serial.print(nodes[i].isSynced() ? F(" synced") : F(" waiting"));
+    Serial.print(F(" error="));
+    Serial.print(errorUs(i));
+    Serial.print(F("us step="));
+    Serial.print(stepMs[i]);
+    Serial.print(F("ms"));
+  }
+  Serial.println();
+}
+
+void check()
+{
+  bool pass = true;
+
+  for (uint8_t i = 1; i < NODES; i++)
+  {
+    long error = errorUs(i);
+    long stepError = stepMs[i] - (long)START_MS[i];
+
+    if (!nodes[i].isSynced() || abs(error) > PASS_ERROR_US || abs(stepError) > PASS_STEP_MS)
+    {
+      pass = false;
+    }
+  }
+
+  Serial.println(pass ? F("PASS") : F("FAIL"));
+}
+
+void setup()
+{
+  Serial.begin(115200);
+
+  for (uint8_t i = 0; i < NODES; i++)
+  {
+    udp[i].ip = IPAddress(10, 0, 0, i + 1);
+    bus[i] = &udp[i];
+  }
+}
+
+void loop()
+{
+  if (finished) { return; }
+
+  for (uint8_t i = 0; i < NODES; i++)
+  {
+    if (!started[i] && millis() >= START_MS[i]) { startNode(i); }
+    if (!started[i]) { continue; }
+
+    nodes[i].loop();
+    stepMs[i] += nodes[i].takeStepMs();
+  }
+
+  if ((millis() - lastReport) >= REPORT_MS)
+  {
+    lastReport = millis();
+    report();
+  }
+
+  if (millis() >= RUN_MS)
+  {
+    check();
+    finished = true;
+  }
+}
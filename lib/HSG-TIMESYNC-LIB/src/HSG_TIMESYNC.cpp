@@ -0,0 +1,400 @@
+/*
+ * HSG_TIMESYNC.cpp
+ */
+
+#include "HSG_TIMESYNC.h"
+
+void HSG_TIMESYNC::begin(UDP * udp)
+{
+  // The group is left alone, config restored at boot may already have set it
+  _udp = udp;
+
+  // Only needs to tell nodes apart (and skip our own multicasts), 0 means no leader
+  _nodeId = ((uint32_t)random(0x7FFFFFFF) ^ _localMicros()) | 1;
+
+  _lastMicros = _localMicros();
+}
+
+void HSG_TIMESYNC::loop()
+{
+  // Keep the 64-bit clock extended even when idle
+  _now();
+
+  if (!_udp || !_enabled) { return; }
+
+  if (!_started)
+  {
+    if (_lastStartMs && (millis() - _lastStartMs) < TIMESYNC_RETRY_MS) { return; }
+    _start();
+    if (!_started) { return; }
+  }
+
+  _receive();
+
+  if ((millis() - _lastSendMs) < _intervalMs) { return; }
+  _lastSendMs = millis();
+
+  TimeSyncPacket packet;
+  memset(&packet, 0, sizeof(packet));
+
+  if (_leader)
+  {
+    _send(TIMESYNC_ANNOUNCE, _group, _port, &packet);
+    return;
+  }
+
+  if (_leaderId == 0) { return; }
+
+  // Free run on our last estimate if the leader goes quiet, a new one will be stepped to
+  if ((millis() - _leaderSeenMs) > (_intervalMs * TIMESYNC_LEADER_TIMEOUT))
+  {
+    _logger->println(F("[tsyn] leader lost, free running"));
+    _leaderId = 0;
+    _waiting = false;
+    return;
+  }
+
+  // Any unanswered request is simply replaced
+  packet.sequence = ++_sequence;
+  packet.originUs = _requestUs = _now();
+  _waiting = true;
+  _send(TIMESYNC_REQUEST, _leaderIp, _leaderPort, &packet);
+}
+
+void HSG_TIMESYNC::setLogger(Print * logger)
+{
+  _logger = logger;
+}
+
+void HSG_TIMESYNC::conf(JsonVariant json)
+{
+  if (!json.containsKey("timeSync")) { return; }
+
+  JsonVariant config = json["timeSync"];
+
+  bool enabled = config["enabled"] | true;
+  bool leader = config["leader"] | false;
+  IPAddress group;
+  if (!group.fromString(config["group"] | DEFAULT_TIMESYNC_GROUP))
+  {
+    group.fromString(DEFAULT_TIMESYNC_GROUP);
+  }
+  uint16_t port = config["port"] | DEFAULT_TIMESYNC_PORT;
+
+  _intervalMs = max((uint32_t)(config["intervalMs"] | DEFAULT_TIMESYNC_INTERVAL_MS), (uint32_t)100);
+  _updateMs = (config["updateSeconds"] | (DEFAULT_TIMESYNC_UPDATE_MS / 1000)) * 1000L;
+
+  // Re-join (and re-lock) if anything about the link changed
+  if (enabled != _enabled || leader != _leader || group != _group || port != _port)
+  {
+    if (_started && _udp) { _udp->stop(); }
+    _started = false;
+    _lastStartMs = 0;
+    _unlock();
+  }
+
+  _enabled = enabled;
+  _leader = leader;
+  _group = group;
+  _port = port;
+}
+
+void HSG_TIMESYNC::tele(JsonVariant json)
+{
+  // Ignore if disabled or reporting has been turned off
+  if (!_enabled || _updateMs == 0) { return; }
+
+  // Check if we are ready to publish
+  if ((millis() - _lastUpdate) <= _updateMs) { return; }
+
+  JsonObject timeSync = json["timeSync"].to<JsonObject>();
+  timeSync["role"] = _leader ? "leader" : "follower";
+
+  if (!_leader)
+  {
+    timeSync["synced"] = isSynced();
+    timeSync["offsetMs"] = _offsetAt(_now()) / 1000.0;
+    timeSync["delayUs"] = _lastDelayUs;
+    timeSync["errorUs"] = _lastErrorUs;
+    timeSync["driftPpm"] = _driftPpm;
+    timeSync["steps"] = _steps;
+  }
+
+  // Reset our timer
+  _lastUpdate = millis();
+}
+
+uint64_t HSG_TIMESYNC::getMicros()
+{
+  uint64_t localUs = _now();
+  return localUs + _offsetAt(localUs);
+}
+
+uint32_t HSG_TIMESYNC::getMillis()
+{
+  uint32_t ms = getMicros() / 1000;
+
+  // Slewing can nudge the clock back a touch, hold until it catches up (steps are allowed through)
+  if (!_stepped && (int32_t)(ms - _lastMillis) < 0) { return _lastMillis; }
+
+  _stepped = false;
+  _lastMillis = ms;
+  return ms;
+}
+
+bool HSG_TIMESYNC::isLeader()
+{
+  return _enabled && _leader;
+}
+
+bool HSG_TIMESYNC::isSynced()
+{
+  return _enabled && (_leader || (_locked && _leaderId != 0));
+}
+
+int32_t HSG_TIMESYNC::takeStepMs()
+{
+  // Whole ms only, the remainder is kept for next time
+  int32_t stepMs = _stepUs / 1000;
+  _stepUs -= (int64_t)stepMs * 1000;
+  return stepMs;
+}
+
+uint32_t HSG_TIMESYNC::_localMicros()
+{
+  return micros();
+}
+
+/*
+ * Local clock in µs, micros() extended to 64 bits (so must be polled at least every 71 minutes)
+ */
+uint64_t HSG_TIMESYNC::_now()
+{
+  uint32_t micros32 = _localMicros();
+  _localUs += (uint32_t)(micros32 - _lastMicros);
+  _lastMicros = micros32;
+  return _localUs;
+}
+
+/*
+ * Estimated offset from local to network time at a given local time
+ */
+int64_t HSG_TIMESYNC::_offsetAt(uint64_t localUs)
+{
+  if (!_locked) { return 0; }
+
+  int64_t sinceBase = (int64_t)(localUs - _baseUs);
+  int64_t offsetUs = _offsetUs + (int64_t)(_driftPpm * sinceBase / 1000000.0);
+
+  if (sinceBase >= _slewPeriodUs) { return offsetUs + _slewUs; }
+  if (sinceBase > 0) { offsetUs += _slewUs * sinceBase / _slewPeriodUs; }
+  return offsetUs;
+}
+
+void HSG_TIMESYNC::_start()
+{
+  _lastStartMs = millis() | 1;
+  _started = _udp->beginMulticast(_group, _port) != 0;
+
+  if (_started)
+  {
+    _logger->print(F("[tsyn] started as "));
+    _logger->println(_leader ? F("leader") : F("follower"));
+  }
+}
+
+void HSG_TIMESYNC::_send(uint8_t type, IPAddress ip, uint16_t port, TimeSyncPacket * packet)
+{
+  packet->magic = TIMESYNC_MAGIC;
+  packet->version = TIMESYNC_VERSION;
+  packet->type = type;
+  packet->nodeId = _nodeId;
+
+  _udp->beginPacket(ip, port);
+
+  // Stamp as late as possible so our own send overhead is not counted as network delay
+  if (type == TIMESYNC_RESPONSE)
+  {
+    packet->transmitUs = getMicros();
+  }
+
+  _udp->write((const uint8_t *)packet, sizeof(TimeSyncPacket));
+  _udp->endPacket();
+}
+
+void HSG_TIMESYNC::_receive()
+{
+  while (_udp->parsePacket() > 0)
+  {
+    // Stamp on arrival, before anything else can add latency
+    uint64_t receivedUs = _now();
+
+    TimeSyncPacket packet;
+    if (_udp->read((uint8_t *)&packet, sizeof(packet)) != sizeof(packet)) { continue; }
+    if (packet.magic != TIMESYNC_MAGIC || packet.version != TIMESYNC_VERSION) { continue; }
+
+    // Multicast loops back to the sender
+    if (packet.nodeId == _nodeId) { continue; }
+
+    switch (packet.type)
+    {
+      case TIMESYNC_ANNOUNCE:
+        _handleAnnounce(&packet);
+        break;
+
+      case TIMESYNC_REQUEST:
+        _handleRequest(&packet, receivedUs);
+        break;
+
+      case TIMESYNC_RESPONSE:
+        _handleResponse(&packet, receivedUs);
+        break;
+    }
+  }
+}
+
+void HSG_TIMESYNC::_handleAnnounce(TimeSyncPacket * packet)
+{
+  if (_leader)
+  {
+    _logger->println(F("[tsyn] another leader is announcing, check config"));
+    return;
+  }
+
+  // With more than one leader the lowest id wins, so every follower agrees
+  if (_leaderId != 0 && packet->nodeId != _leaderId && packet->nodeId > _leaderId) { return; }
+
+  if (packet->nodeId != _leaderId)
+  {
+    _logger->print(F("[tsyn] following leader at "));
+    _logger->println(_udp->remoteIP());
+
+    // Samples against another clock are meaningless, query straight away
+    _leaderId = packet->nodeId;
+    _sampleCount = 0;
+    _sampleNext = 0;
+    _waiting = false;
+    _lastSendMs = millis() - _intervalMs;
+  }
+
+  _leaderIp = _udp->remoteIP();
+  _leaderPort = _udp->remotePort();
+  _leaderSeenMs = millis();
+}
+
+void HSG_TIMESYNC::_handleRequest(TimeSyncPacket * packet, uint64_t receivedUs)
+{
+  if (!_leader) { return; }
+
+  TimeSyncPacket response;
+  memset(&response, 0, sizeof(response));
+  response.sequence = packet->sequence;
+  response.originUs = packet->originUs;
+  response.receiveUs = receivedUs + _offsetAt(receivedUs);
+
+  _send(TIMESYNC_RESPONSE, _udp->remoteIP(), _udp->remotePort(), &response);
+}
+
+void HSG_TIMESYNC::_handleResponse(TimeSyncPacket * packet, uint64_t receivedUs)
+{
+  if (_leader || !_waiting) { return; }
+
+  // Ignore stale or duplicated responses
+  if (packet->nodeId != _leaderId || packet->sequence != _sequence || packet->originUs != _requestUs) { return; }
+  _waiting = false;
+
+  // Standard NTP arithmetic, t1/t4 are on our clock and t2/t3 on the leader's
+  int64_t outbound = (int64_t)(packet->receiveUs - packet->originUs);
+  int64_t inbound = (int64_t)(packet->transmitUs - receivedUs);
+  int64_t delay = (int64_t)(receivedUs - packet->originUs) - (int64_t)(packet->transmitUs - packet->receiveUs);
+
+  _addSample((outbound + inbound) / 2, delay > 0 ? (uint32_t)delay : 0, receivedUs);
+}
+
+/*
+ * Filter a new exchange and steer our estimate towards it. Queueing only
+ * ever adds delay, so the exchange with the lowest round trip out of the
+ * last few is the most trustworthy one. Each is only steered towards once,
+ * so a good sample doesn't keep feeding the same error into the drift
+ */
+void HSG_TIMESYNC::_addSample(int64_t offsetUs, uint32_t delayUs, uint64_t localUs)
+{
+  TimeSyncSample * sample = &_samples[_sampleNext];
+  sample->localUs = localUs;
+  sample->offsetUs = offsetUs;
+  sample->delayUs = delayUs;
+  sample->used = false;
+  _sampleNext = (_sampleNext + 1) % TIMESYNC_SAMPLES;
+  if (_sampleCount < TIMESYNC_SAMPLES) { _sampleCount++; }
+
+  TimeSyncSample * best = &_samples[0];
+  for (uint8_t i = 1; i < _sampleCount; i++)
+  {
+    if (_samples[i].delayUs < best->delayUs) { best = &_samples[i]; }
+  }
+  _lastDelayUs = best->delayUs;
+
+  if (_locked && best->used) { return; }
+  best->used = true;
+
+  // Judge the sample against our estimate at the time it was taken
+  int64_t error = best->offsetUs - _offsetAt(best->localUs);
+
+  // Step on first lock or after a big jump (e.g. a new leader), and start filtering afresh
+  if (!_locked || error > TIMESYNC_STEP_US || error < -TIMESYNC_STEP_US)
+  {
+    uint64_t nowUs = _now();
+    int64_t before = _offsetAt(nowUs);
+
+    _offsetUs = best->offsetUs;
+    _baseUs = best->localUs;
+    _slewUs = 0;
+    _locked = true;
+    _stepped = true;
+    _steps++;
+    _lastErrorUs = 0;
+    _stepUs += _offsetAt(nowUs) - before;
+
+    _samples[0] = *best;
+    _sampleCount = 1;
+    _sampleNext = 1;
+
+    _logger->println(F("[tsyn] clock stepped to leader"));
+    return;
+  }
+
+  _lastErrorUs = error;
+
+  // Whatever error is left after the last correction is down to drift
+  uint64_t nowUs = _now();
+  int64_t offsetNow = _offsetAt(nowUs);
+  int64_t sinceBase = (int64_t)(nowUs - _baseUs);
+  if (sinceBase > 0)
+  {
+    _driftPpm += TIMESYNC_DRIFT_GAIN * error * 1000000.0 / sinceBase;
+    _driftPpm = constrain(_driftPpm, -TIMESYNC_MAX_DRIFT_PPM, TIMESYNC_MAX_DRIFT_PPM);
+  }
+
+  // Slew the phase, re-basing at now so the correction applies from here on (and gradually,
+  // so it never shows up as a jump anything timed on network time would need moving for)
+  _offsetUs = offsetNow;
+  _baseUs = nowUs;
+  _slewUs = (int64_t)(TIMESYNC_PHASE_GAIN * error);
+  _slewPeriodUs = max((int64_t)_intervalMs * 1000, (_slewUs < 0 ? -_slewUs : _slewUs) * 1000000 / TIMESYNC_MAX_SLEW_PPM);
+}
+
+void HSG_TIMESYNC::_unlock()
+{
+  // Back to local time, which is a step too
+  _stepUs -= _offsetAt(_now());
+
+  _locked = false;
+  _stepped = true;
+  _offsetUs = 0;
+  _slewUs = 0;
+  _driftPpm = 0;
+  _leaderId = 0;
+  _waiting = false;
+  _sampleCount = 0;
+  _sampleNext = 0;
+}
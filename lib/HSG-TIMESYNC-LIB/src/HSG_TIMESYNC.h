@@ -0,0 +1,177 @@
+/*
+ * HSG_TIMESYNC.h
+ *
+ * Shares a common timebase between controllers on the same network. One
+ * node is configured as leader and announces itself over UDP multicast,
+ * followers query it with NTP-style request/response exchanges and track
+ * its clock with an offset and drift estimate. Only the abstract Arduino
+ * UDP interface is used, and the local clock can be overridden, so several
+ * instances can be run against each other on loopback (see the
+ * LoopbackSync example).
+ */
+
+#ifndef HSG_TIMESYNC_H
+#define HSG_TIMESYNC_H
+
+#include <Arduino.h>
+#include <ArduinoJson.h>
+#include <Udp.h>
+
+#define DEFAULT_TIMESYNC_GROUP          "239.255.72.83"
+#define DEFAULT_TIMESYNC_PORT           7283
+#define DEFAULT_TIMESYNC_INTERVAL_MS    1000
+#define DEFAULT_TIMESYNC_UPDATE_MS      60000
+
+// Followers drop a leader (and keep free running) after this many missed announces
+#define TIMESYNC_LEADER_TIMEOUT         5
+
+// Retry joining the multicast group until the network is up
+#define TIMESYNC_RETRY_MS               5000
+
+// Exchanges kept for the minimum delay filter
+#define TIMESYNC_SAMPLES                8
+
+// Errors larger than this are stepped rather than slewed
+#define TIMESYNC_STEP_US                100000
+
+// Loop gains, phase error is halved each correction and a twentieth feeds the drift estimate
+#define TIMESYNC_PHASE_GAIN             0.5
+#define TIMESYNC_DRIFT_GAIN             0.05
+#define TIMESYNC_MAX_DRIFT_PPM          500.0
+
+// Phase corrections are slewed in over a sync interval, or slower so network time never
+// runs more than 1% fast or slow (up to 5s for the largest correction short of a step)
+#define TIMESYNC_MAX_SLEW_PPM           10000
+
+// Packet types
+#define TIMESYNC_MAGIC                  0x54475348    // "HSGT"
+#define TIMESYNC_VERSION                1
+#define TIMESYNC_ANNOUNCE               1
+#define TIMESYNC_REQUEST                2
+#define TIMESYNC_RESPONSE               3
+
+// Sent as-is, all of our targets are little endian
+struct __attribute__((packed)) TimeSyncPacket
+{
+  uint32_t magic;
+  uint8_t  version;
+  uint8_t  type;
+  uint16_t reserved;
+  uint32_t nodeId;
+  uint32_t sequence;
+  uint64_t originUs;                      // t1, follower clock when the request was sent
+  uint64_t receiveUs;                     // t2, leader clock when the request arrived
+  uint64_t transmitUs;                    // t3, leader clock when the response was sent
+};
+
+struct TimeSyncSample
+{
+  uint64_t localUs;                       // t4, local clock when the response arrived
+  int64_t  offsetUs;
+  uint32_t delayUs;
+  bool     used;                          // already steered towards
+};
+
+class HSG_TIMESYNC
+{
+public:
+  // Takes the socket to use, nothing is sent until enabled by config
+  void begin(UDP * udp);
+  void loop();
+
+  // Where to log, Serial until set
+  void setLogger(Print * logger);
+
+  // Handles {"timeSync": {"enabled", "leader", "group", "port", "intervalMs"}}
+  void conf(JsonVariant json);
+  void tele(JsonVariant json);
+
+  // Network time, local time until a follower has locked to a leader
+  uint64_t getMicros(void);
+
+  // Network time in ms, never runs backwards once locked
+  uint32_t getMillis(void);
+
+  bool isLeader(void);
+  bool isSynced(void);
+
+  // How far network time has jumped (ms) through steps since the last call, anything
+  // timestamped on the old timebase should be moved by this to carry on smoothly
+  int32_t takeStepMs(void);
+
+protected:
+  // Local clock, overridden to simulate skewed controllers
+  virtual uint32_t _localMicros(void);
+
+private:
+  UDP * _udp = NULL;
+  Print * _logger = &Serial;
+
+  bool _enabled = false;
+  bool _leader = false;
+  bool _started = false;
+  IPAddress _group;
+  uint16_t _port = DEFAULT_TIMESYNC_PORT;
+  uint32_t _intervalMs = DEFAULT_TIMESYNC_INTERVAL_MS;
+  uint32_t _nodeId = 0;
+
+  // 64-bit extension of micros()
+  uint64_t _localUs = 0;
+  uint32_t _lastMicros = 0;
+
+  uint32_t _lastSendMs = 0;
+  uint32_t _lastStartMs = 0;
+
+  // Leader we are following
+  uint32_t _leaderId = 0;
+  IPAddress _leaderIp;
+  uint16_t _leaderPort = 0;
+  uint32_t _leaderSeenMs = 0;
+
+  // Outstanding request
+  uint32_t _sequence = 0;
+  uint64_t _requestUs = 0;
+  bool _waiting = false;
+
+  TimeSyncSample _samples[TIMESYNC_SAMPLES];
+  uint8_t _sampleCount = 0;
+  uint8_t _sampleNext = 0;
+
+  // Offset from local to network time at _baseUs, plus drift since then
+  bool _locked = false;
+  int64_t _offsetUs = 0;
+  uint64_t _baseUs = 0;
+  double _driftPpm = 0;
+
+  // Phase correction being slewed in over the period from _baseUs
+  int64_t _slewUs = 0;
+  int64_t _slewPeriodUs = 0;
+  uint32_t _lastDelayUs = 0;
+  int32_t _lastErrorUs = 0;
+  uint32_t _steps = 0;
+
+  uint32_t _lastMillis = 0;
+  bool _stepped = true;
+
+  // Steps not yet collected by takeStepMs()
+  int64_t _stepUs = 0;
+
+  uint32_t _updateMs = DEFAULT_TIMESYNC_UPDATE_MS;
+  uint32_t _lastUpdate = 0;
+
+  uint64_t _now(void);
+  int64_t _offsetAt(uint64_t localUs);
+
+  void _start(void);
+  void _send(uint8_t type, IPAddress ip, uint16_t port, TimeSyncPacket * packet);
+  void _receive(void);
+
+  void _handleAnnounce(TimeSyncPacket * packet);
+  void _handleRequest(TimeSyncPacket * packet, uint64_t receivedUs);
+  void _handleResponse(TimeSyncPacket * packet, uint64_t receivedUs);
+
+  void _addSample(int64_t offsetUs, uint32_t delayUs, uint64_t localUs);
+  void _unlock(void);
+};
+
+#endif
@@ -27,9 +27,10 @@
 WiFiClient _client;
 WiFiServer _server(REST_API_PORT);
 
-// MQTT client
-PubSubClient _mqttClient(_client);
-HSG_MQTT _mqtt(_mqttClient);
+// MQTT client (the transport wrapper adds QoS 1 delivery for status)
+HSG_MQTT_CLIENT _mqttTransport(_client);
+PubSubClient _mqttClient(_mqttTransport);
+HSG_MQTT _mqtt(_mqttClient, &_mqttTransport);
 
 // REST API
 HSG_API _api(_mqtt);
@@ -41,12 +42,14 @@ MqttLogger _logger(_mqttClient, "log", MqttLoggerMode::SerialOnly);
 const uint8_t * _fwLogo;
  
 // Supported firmware config and command schemas
-DynamicJsonDocument _fwConfigSchema(1024);
-DynamicJsonDocument _fwCommandSchema(1024);
+TrackedJsonDocument<HEAP_TAG_ADOPT> _fwConfigSchema(1024);
+TrackedJsonDocument<HEAP_TAG_ADOPT> _fwCommandSchema(1024);
 
 // MQTT callbacks wrapped by _mqttConfig/_mqttCommand
 jsonCallback _onConfig;
 jsonCallback _onCommand;
+plainCallback _onPlainCommand;
+connectedCallback _onConnected;
 
 // Connection state flags
 bool _ethernetConnected = false;
@@ -55,6 +58,10 @@ bool _mqttClientConnected = false;
 // Stored MQTT config
 char _topicPrefix[64];
 
+// Shared group topics we are subscribed to
+char _groupTopics[MAX_GROUP_TOPICS][GROUP_TOPIC_NAME_SIZE];
+uint8_t _groupTopicCount = 0;
+
 // Forward declaration for our helper
 bool _publishWithCorrectTopic(const char *, JsonVariant);
 
@@ -136,6 +143,7 @@ void _getSystemJson(JsonVariant json)
   system["heapUsedBytes"] = ESP.getHeapSize();
   system["heapFreeBytes"] = ESP.getFreeHeap();
   system["heapMaxAllocBytes"] = ESP.getMaxAllocHeap();
+  system["heapMinFreeBytes"] = ESP.getMinFreeHeap();
   system["flashChipSizeBytes"] = ESP.getFlashChipSize();
 
   system["sketchSpaceUsedBytes"] = ESP.getSketchSize();
@@ -170,9 +178,9 @@ void _getI2CJson(JsonVariant json)
 
 void _getI2cConfigJson(JsonVariant json)
 {
-  JsonObject properties = json["properties"].to<JsonObject>();
+  JsonObject properties = json["properties"];
 
-  DynamicJsonDocument pcaJson(1024);
+  TrackedJsonDocument<HEAP_TAG_ADOPT> pcaJson(1024);
   _getI2CJson(pcaJson.as<JsonVariant>());
   JsonArray pcaArray = pcaJson["i2c"]["pca9685"].as<JsonArray>();
 
@@ -208,7 +216,7 @@ void _getI2cConfigJson(JsonVariant json)
 
 void _getGroupConfigJson(JsonVariant json)
 {
-    JsonObject properties = json["properties"].to<JsonObject>();
+    JsonObject properties = json["properties"];
     JsonObject groups = properties["groups"].to<JsonObject>();
     groups["title"] = "Group Definitions";
     groups["description"] = "Define groups of outputs that can be controlled together.";
@@ -219,6 +227,16 @@ void _getGroupConfigJson(JsonVariant json)
     
     JsonObject items = additionalProperties["items"].to<JsonObject>();
     items["type"] = "integer";
+
+    JsonObject groupTopics = properties["groupTopics"].to<JsonObject>();
+    groupTopics["title"] = "Group Topics";
+    groupTopics["description"] = "Shared <prefix>group/<name>/cmnd topics to listen on, commands apply to the members of the local group with the same name.";
+    groupTopics["type"] = "array";
+    groupTopics["maxItems"] = MAX_GROUP_TOPICS;
+
+    JsonObject groupTopicItems = groupTopics["items"].to<JsonObject>();
+    groupTopicItems["type"] = "string";
+    groupTopicItems["maxLength"] = GROUP_TOPIC_NAME_SIZE - 1;
 }
 
 
@@ -272,28 +290,195 @@ void _apiAdopt(JsonVariant json)
   _getCommandSchemaJson(json);
 }
 
-/* MQTT callbacks */
-void _mqttConnected() 
+/* Group topic helpers */
+char * _getGroupTopic(char topic[], const char * group)
 {
-  if (_mqttClientConnected)
+  sprintf(topic, "%sgroup/%s/cmnd", _topicPrefix, group);
+  return topic;
+}
+
+void _subscribeGroupTopics(bool subscribe)
+{
+  char topic[128];
+  for (uint8_t i = 0; i < _groupTopicCount; i++)
+  {
+    _getGroupTopic(topic, _groupTopics[i]);
+    if (subscribe)
+    {
+      _mqtt.subscribe(topic);
+      _logger.print(F("[poe] subscribed to group topic: "));
+      _logger.println(topic);
+    }
+    else
+    {
+      _mqttClient.unsubscribe(topic);
+    }
+  }
+}
+
+// Returns the group name if this is one of our group topics, NULL otherwise
+const char * _matchGroupTopic(const char * topic)
+{
+  int prefixLength = strlen(_topicPrefix);
+  if (strncmp(topic, _topicPrefix, prefixLength) != 0) { return NULL; }
+
+  topic += prefixLength;
+  if (strncmp(topic, "group/", 6) != 0) { return NULL; }
+
+  topic += 6;
+  const char * end = strchr(topic, '/');
+  if (!end || strcmp(end, "/cmnd") != 0) { return NULL; }
+
+  int nameLength = end - topic;
+  for (uint8_t i = 0; i < _groupTopicCount; i++)
+  {
+    if (strncmp(_groupTopics[i], topic, nameLength) == 0 && _groupTopics[i][nameLength] == '\0')
+    {
+      return _groupTopics[i];
+    }
+  }
+  return NULL;
+}
+
+/* Plain payload helpers, these skip ArduinoJson entirely */
+bool _parsePlainNumber(const char ** p, long max, long * value)
+{
+  if (!isdigit(**p)) { return false; }
+
+  *value = 0;
+  while (isdigit(**p))
   {
-    return;
+    *value = (*value * 10) + (*(*p)++ - '0');
+    if (*value > max) { return false; }
   }
+  return true;
+}
+
+// Parses "50", "ON", "OFF" or "50,2000" (brightness or state, then an optional fade in ms)
+bool _parsePlainPayload(const char * payload, int * brightness, int * fadeMs)
+{
+  const char * p = payload;
+  while (*p == ' ') { p++; }
+
+  long value;
+  if (strncasecmp(p, "ON", 2) == 0)
+  {
+    *brightness = PLAIN_ON;
+    p += 2;
+  }
+  else if (strncasecmp(p, "OFF", 3) == 0)
+  {
+    *brightness = 0;
+    p += 3;
+  }
+  else if (_parsePlainNumber(&p, 100, &value))
+  {
+    *brightness = value;
+  }
+  else
+  {
+    return false;
+  }
+
+  *fadeMs = PLAIN_DEFAULT_FADE;
+  if (*p == ',')
+  {
+    p++;
+    if (!_parsePlainNumber(&p, PLAIN_MAX_FADE_MS, &value)) { return false; }
+    *fadeMs = value;
+  }
+
+  while (*p == ' ' || *p == '\r' || *p == '\n') { p++; }
+  return *p == '\0';
+}
+
+// Handles <command topic>/output/N and <command topic>/group/name, returns false if not a plain topic
+bool _plainCommand(const char * subtopic, const char * message)
+{
+  int output = 0;
+  const char * group = NULL;
+
+  if (strncmp(subtopic, "output/", 7) == 0)
+  {
+    const char * p = subtopic + 7;
+    long value;
+    if (!_parsePlainNumber(&p, 0xFFFF, &value) || *p != '\0') { return false; }
+    output = value;
+  }
+  else if (strncmp(subtopic, "group/", 6) == 0 && subtopic[6] != '\0')
+  {
+    group = subtopic + 6;
+  }
+  else
+  {
+    return false;
+  }
+
+  int brightness, fadeMs;
+  if (!_parsePlainPayload(message, &brightness, &fadeMs))
+  {
+    _logger.println(F("[poe] invalid plain command payload"));
+    return true;
+  }
+
+  if (_onPlainCommand) { _onPlainCommand(output, group, brightness, fadeMs); }
+  return true;
+}
+
+/* MQTT callbacks */
+void _mqttConnected() 
+{
+  // Runs on every connect, a dropped connection is re-established without a disconnect callback
   _mqttClientConnected = true;
 
   // Publish device adoption info with the correct structure
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_ADOPT> json(1024);
   _apiAdopt(json.as<JsonVariant>());
   _publishWithCorrectTopic("adopt", json.as<JsonVariant>());
 
   _logger.println("[poe] mqtt connected");
 
-  // Manually subscribe to the correctly formatted command topic
-  static char commandTopic[128];
-  sprintf(commandTopic, "%s%s/cmnd", _topicPrefix, _mqtt.getClientId());
-  _mqttClient.subscribe(commandTopic);
-  _logger.print(F("[poe] subscribed to command topic: "));
-  _logger.println(commandTopic);
+  // Status (including per-output and snapshot topics) is delivered at QoS 1
+  char statusTopic[128];
+  sprintf(statusTopic, "%s%s/stat", _topicPrefix, _mqtt.getClientId());
+  _mqttTransport.setQosPrefix(statusTopic);
+
+  // Our busiest topics go out as 2 byte aliases when speaking MQTT 5
+  char aliasTopic[140];
+  _mqttTransport.clearAliasTopics();
+  _mqttTransport.addAliasTopic(statusTopic);
+  sprintf(aliasTopic, "%s/snapshot", statusTopic);
+  _mqttTransport.addAliasTopic(aliasTopic);
+  sprintf(aliasTopic, "%s%s/tele", _topicPrefix, _mqtt.getClientId());
+  _mqttTransport.addAliasTopic(aliasTopic);
+
+  // Our session (and subscriptions) survived, anything sent while we were away follows
+  if (_mqtt.isSessionResumed())
+  {
+    _logger.println(F("[poe] mqtt session resumed, skipping subscriptions"));
+  }
+  else
+  {
+    // Manually subscribe to the correctly formatted command topic
+    static char commandTopic[128];
+    sprintf(commandTopic, "%s%s/cmnd", _topicPrefix, _mqtt.getClientId());
+    _mqtt.subscribe(commandTopic);
+    _logger.print(F("[poe] subscribed to command topic: "));
+    _logger.println(commandTopic);
+
+    // Plain payload output and group commands beneath it
+    static char plainTopic[140];
+    sprintf(plainTopic, "%s/output/+", commandTopic);
+    _mqtt.subscribe(plainTopic);
+    sprintf(plainTopic, "%s/group/+", commandTopic);
+    _mqtt.subscribe(plainTopic);
+
+    // And any shared group topics
+    _subscribeGroupTopics(true);
+  }
+
+  // Let the firmware republish its state
+  if (_onConnected) { _onConnected(); }
 }
 
 void _mqttDisconnected(int state) 
@@ -328,6 +513,30 @@ void _mqttConfig(JsonVariant json)
       strcat(_topicPrefix, "/");
     }
   }
+
+  // Swap our group topic subscriptions, e.g. {"groupTopics": ["building", "floor1"]}
+  if (json.containsKey("groupTopics"))
+  {
+    if (_mqttClientConnected) { _subscribeGroupTopics(false); }
+
+    _groupTopicCount = 0;
+    for (JsonVariant group : json["groupTopics"].as<JsonArray>())
+    {
+      const char * name = group.as<const char *>();
+      if (!name || strlen(name) >= GROUP_TOPIC_NAME_SIZE || _groupTopicCount >= MAX_GROUP_TOPICS) { continue; }
+      strcpy(_groupTopics[_groupTopicCount++], name);
+    }
+
+    if (_mqttClientConnected)
+    {
+      _subscribeGroupTopics(true);
+    }
+    else
+    {
+      // Changed while offline, our old session would still hold the previous groups
+      _mqtt.resubscribe();
+    }
+  }
   
   if (_onConfig) { _onConfig(json); }
 }
@@ -361,11 +570,13 @@ void _mqttCallback(char * topic, byte * payload, int length)
   static char commandTopic[128];
   sprintf(commandTopic, "%s%s/cmnd", _topicPrefix, _mqtt.getClientId());
 
+  // Shared by our own and group command topics
+  static StaticJsonDocument<1024> json;
+
   // Check if the received topic is our command topic
   if (strcmp(topic, commandTopic) == 0)
   {
     // It's a command for us, process it directly
-    static StaticJsonDocument<1024> json;
     json.clear();
     
     DeserializationError error = deserializeJson(json, message);
@@ -376,6 +587,45 @@ void _mqttCallback(char * topic, byte * payload, int length)
     }
     _mqttCommand(json.as<JsonVariant>());
   }
+  else if (strncmp(topic, commandTopic, strlen(commandTopic)) == 0 && topic[strlen(commandTopic)] == '/' &&
+           _plainCommand(&topic[strlen(commandTopic) + 1], message))
+  {
+    // Handled without building a JSON document
+  }
+  else if (const char * group = _matchGroupTopic(topic))
+  {
+    // Shared across controllers, so only ever act on our local members of the group
+    json.clear();
+
+    DeserializationError error = deserializeJson(json, message);
+    if (error || !json.is<JsonObject>())
+    {
+      _logger.println(F("[poe] failed to deserialise group command json payload"));
+      return;
+    }
+
+    // Only lighting keys are fanned out, anything else (restart, scenes, timers, snapshots...)
+    // must be sent to each controller's own topic
+    static const char * groupKeys[] = { "state", "brightness", "fade", "master", "effect", "period", "min", "max", "spread", "width", "after", "at" };
+
+    static StaticJsonDocument<512> groupCommand;
+    groupCommand.clear();
+
+    for (uint8_t i = 0; i < sizeof(groupKeys) / sizeof(groupKeys[0]); i++)
+    {
+      if (json.containsKey(groupKeys[i])) groupCommand[groupKeys[i]] = json[groupKeys[i]];
+    }
+
+    if (groupCommand.size() == 0)
+    {
+      _logger.println(F("[poe] group command has nothing to apply"));
+      return;
+    }
+
+    groupCommand["group"] = group;
+
+    _mqttCommand(groupCommand.as<JsonVariant>());
+  }
   else
   {
     // Not our command topic, let the library handle it (for config, etc.)
@@ -405,7 +655,7 @@ void HSG_32_POE::begin(jsonCallback config, jsonCallback command)
 
   Wire.begin(I2C_SDA, I2C_SCL);
 
-  DynamicJsonDocument json(1024);
+  TrackedJsonDocument<HEAP_TAG_ADOPT> json(1024);
   _getFirmwareJson(json.as<JsonVariant>());
 
   _logger.print(F("[poe] "));
@@ -425,7 +675,7 @@ void HSG_32_POE::begin(jsonCallback config, jsonCallback command)
   File file = LittleFS.open(MQTT_JSON_PATH, "r");
   if (file)
   {
-    DynamicJsonDocument mqttConfig(1024);
+    TrackedJsonDocument<HEAP_TAG_CONFIG> mqttConfig(1024);
     deserializeJson(mqttConfig, file);
     if (mqttConfig.containsKey("topicPrefix")) {
       strcpy(_topicPrefix, mqttConfig["topicPrefix"]);
@@ -468,10 +718,20 @@ void HSG_32_POE::setConfigSchema(JsonVariant json)
 
 void HSG_32_POE::setCommandSchema(JsonVariant json)
 {
-  _fwConfigSchema.clear();
+  _fwCommandSchema.clear();
   _mergeJson(_fwCommandSchema.as<JsonVariant>(), json);
 }
 
+void HSG_32_POE::onConnected(connectedCallback connected)
+{
+  _onConnected = connected;
+}
+
+void HSG_32_POE::onPlainCommand(plainCallback command)
+{
+  _onPlainCommand = command;
+}
+
 HSG_MQTT * HSG_32_POE::getMQTT()
 {
   return &_mqtt;
@@ -491,13 +751,9 @@ bool _publishWithCorrectTopic(const char * type, JsonVariant json)
   char topic[128];
   sprintf(topic, "%s%s/%s", _topicPrefix, clientId, type);
 
-  // Serialize the JSON payload
-  char payload[256];
-  serializeJson(json, payload, sizeof(payload));
-
-  // Publish the message, retaining the status and adopt messages
+  // Publish the message, retaining the status and adopt messages (streamed, so any size goes out whole)
   bool retain = (strcmp(type, "stat") == 0) || (strcmp(type, "adopt") == 0);
-  return _mqttClient.publish(topic, payload, retain);
+  return _mqtt.publish(json, topic, retain);
 }
 
 bool HSG_32_POE::publishStatus(JsonVariant json)
@@ -506,6 +762,20 @@ bool HSG_32_POE::publishStatus(JsonVariant json)
   return _publishWithCorrectTopic("stat", json);
 }
 
+bool HSG_32_POE::publishStatus(const char * subtopic, const char * payload)
+{
+  if (!_isNetworkConnected()) { return false; }
+
+  char topic[128];
+  snprintf(topic, sizeof(topic), "%s%s/stat/%s", _topicPrefix, _mqtt.getClientId(), subtopic);
+  return _mqttClient.publish(topic, payload, true);
+}
+
+void HSG_32_POE::flushPublishes(void)
+{
+  _mqttTransport.sendBatch();
+}
+
 bool HSG_32_POE::publishTelemetry(JsonVariant json)
 {
   if (!_isNetworkConnected()) { return false; }
@@ -540,6 +810,7 @@ void HSG_32_POE::_initialiseMqtt(byte * mac)
   _mqtt.onCommand(_mqttCommand);
   
   _mqttClient.setCallback(_mqttCallback);
+  _mqttTransport.setLogger(&_logger);
 }
 
 void HSG_32_POE::_initialiseRestApi(void)
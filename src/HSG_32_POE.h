@@ -20,6 +20,18 @@
 // REST API
 #define       REST_API_PORT             80
 
+// Shared group command topics (<prefix>group/<name>/cmnd) one publish reaches every controller on
+#define       MAX_GROUP_TOPICS          8
+#define       GROUP_TOPIC_NAME_SIZE     24
+
+// Plain payload commands on <prefix><clientId>/cmnd/output/N and .../cmnd/group/name
+#define       PLAIN_ON                  -1        // back on at the last brightness
+#define       PLAIN_DEFAULT_FADE        -1
+#define       PLAIN_MAX_FADE_MS         3600000
+
+// Callback type for onPlainCommand(), group is NULL for a single output
+typedef void (* plainCallback)(int output, const char * group, int brightness, int fadeMs);
+
 class HSG_32_POE : public Print
 {
   public:
@@ -28,6 +40,12 @@ class HSG_32_POE : public Print
     void begin(jsonCallback config, jsonCallback command);
     void loop(void);
 
+    // Firmware handler for once MQTT has (re)connected, e.g. to republish state
+    void onConnected(connectedCallback connected);
+
+    // Firmware handler for plain payload ("50", "ON", "OFF", "50,2000") output and group commands
+    void onPlainCommand(plainCallback command);
+
     // Firmware can define the config/commands it supports - for device discovery and adoption
     void setConfigSchema(JsonVariant json);
     void setCommandSchema(JsonVariant json);
@@ -42,6 +60,12 @@ class HSG_32_POE : public Print
     bool publishStatus(JsonVariant json);
     bool publishTelemetry(JsonVariant json);
 
+    // Publish a pre-built payload on a retained stat/ sub-topic, e.g. stat/output/12
+    bool publishStatus(const char * subtopic, const char * payload);
+
+    // Send publishes batched since the last call, e.g. at the end of a frame
+    void flushPublishes(void);
+
     // Implement Print.h wrapper
     virtual size_t write(uint8_t);
     using Print::write;
@@ -9,6 +9,10 @@
 #include <Arduino.h>
 #include <Adafruit_PWMServoDriver.h> // For PCA9685
 #include <HSG_SENSORS.h>              // For QWICC I2C sensors
+#include <HSG_HEAP.h>                 // For heap allocation tracking
+#include <HSG_SCHEDULER.h>            // For delayed and timed commands
+#include <HSG_TIMESYNC.h>             // For a shared frame clock across controllers
+#include <WiFiUdp.h>                  // UDP socket for time sync (works over Ethernet too)
 
 // Board support package chooser
 #if defined(HSG_ESP32_POE)
@@ -26,14 +30,116 @@ OXRS_Rack32 oxrs(FW_LOGO);
 
 // PCA9685 details
 #define MAX_PCA9685_BOARDS 10
+#define PCA9685_CHANNELS 16
 Adafruit_PWMServoDriver pca[MAX_PCA9685_BOARDS];
 byte pca_addr[MAX_PCA9685_BOARDS];
 int pca_count = 0;
 
+// PCA9685 register holding LED0_ON_L, each channel has 4 registers from here
+#define PCA9685_LED0_REGISTER 0x06
+
 // Maximum number of logical outputs
 #define MAX_OUTPUTS 160 // 10 boards * 16 channels
 #define DEFAULT_FADE_MS 1000 // Default fade duration is 1 second
 
+// Fades are advanced, rendered and flushed to the boards once per frame
+#define FRAME_MS 10
+
+// Worst case run-length snapshot is every output at a different 3 digit level
+#define SNAPSHOT_PAYLOAD_SIZE 1024
+
+// Merged device config, rule actions, scenes, fixtures and groups are read from it when they run
+#define CONFIG_DOC_SIZE 16384
+
+// Telemetry document, heap, time sync and all three sensor channels (with stats) in one report
+#define TELEMETRY_DOC_SIZE 2048
+
+// Output multipliers in the render path are Q12 fixed point (4096 = 100%)
+#define SCALE_ONE 4096
+
+// Thermal derating defaults
+#define DEFAULT_THERMAL_START_C 60
+#define DEFAULT_THERMAL_END_C 80
+#define DEFAULT_THERMAL_MIN_PERCENT 30
+#define DEFAULT_THERMAL_RATE 2            // % ceiling change per second
+#define DEFAULT_THERMAL_HYSTERESIS_C 3
+
+// Daylight harvesting controller defaults
+#define DEFAULT_DAYLIGHT_KP 0.02          // % brightness per lux of error
+#define DEFAULT_DAYLIGHT_KI 0.01          // % brightness per lux of error per second
+#define DEFAULT_DAYLIGHT_DEADBAND_LUX 20
+#define DEFAULT_DAYLIGHT_MAX_RATE 5       // % brightness per second
+#define DAYLIGHT_MAX_STEP_MS 5000         // Cap on the time step after a gap in samples
+
+// Fixtures group several outputs into one light
+#define MAX_FIXTURES 32
+#define MAX_FIXTURE_CHANNELS 5
+#define FIXTURE_NAME_SIZE 16
+
+// Fixture types
+#define FIXTURE_CCT 0
+#define FIXTURE_RGB 1
+#define FIXTURE_RGBW 2
+#define FIXTURE_RGBCCT 3
+
+// Colour spaces fixture colours are faded in
+#define COLOUR_SPACE_RGB 0
+#define COLOUR_SPACE_HSV 1
+
+// Tunable white defaults
+#define DEFAULT_WARM_K 2700
+#define DEFAULT_COOL_K 6500
+
+// Fixture components, faded together and mixed into the channels by a per-type kernel
+#define FIXTURE_LEVEL 0                   // 0-4095
+#define FIXTURE_MIRED 1                   // white colour temperature in mireds (Q4)
+#define FIXTURE_WHITE 2                   // white amount (Q12)
+#define FIXTURE_COLOUR 3                  // R, G, B or H, S, - (Q12)
+#define FIXTURE_COMPONENTS 6
+
+// Fixture fades use a Q16 progress fraction
+#define FIXTURE_PROGRESS_ONE 65536
+
+// Procedural effects
+#define MAX_EFFECTS 8
+#define DEFAULT_EFFECT_PERIOD_MS 4000
+#define SINE_TABLE_SIZE 256
+
+// Effect types
+#define EFFECT_BREATHE 0
+#define EFFECT_CANDLE 1
+#define EFFECT_CHASE 2
+#define EFFECT_WAVE 3
+
+// Group submasters (one bit per slot in each output's mask)
+#define MAX_GROUP_MASTERS 32
+#define MASTER_NAME_SIZE 16
+
+// Control layers, highest priority first
+#define LAYER_OVERRIDE 0
+#define LAYER_SCHEDULE 1
+#define LAYER_AUTOMATION 2
+#define LAYER_DEFAULT 3
+#define LAYER_COUNT 4
+
+// Rule engine limits
+#define MAX_RULES 32
+#define MAX_RULE_CONDITIONS 64
+
+// Rule condition sources
+#define RULE_SOURCE_TEMPERATURE 0
+#define RULE_SOURCE_HUMIDITY 1
+#define RULE_SOURCE_LUX 2
+#define RULE_SOURCE_OUTPUT 3
+
+// Rule comparison operators
+#define RULE_OP_LT 0
+#define RULE_OP_LE 1
+#define RULE_OP_GT 2
+#define RULE_OP_GE 3
+#define RULE_OP_EQ 4
+#define RULE_OP_NE 5
+
 /*--------------------------- Global State ---------------------------*/
 // This struct holds the complete state for each output, including fading information
 struct OutputState {
@@ -42,185 +148,2576 @@ struct OutputState {
   int targetPwmValue = 0;
   unsigned long fadeStartTime = 0;
   unsigned long fadeDuration = DEFAULT_FADE_MS;
+  unsigned long nextChangeTime = 0;   // when the 12-bit value next moves
 };
 OutputState outputs[MAX_OUTPUTS];
 
+// Active fades in a min-heap keyed on nextChangeTime, with each output's heap position (-1 if idle)
+uint8_t fadeHeap[MAX_OUTPUTS];
+int16_t fadeHeapPosition[MAX_OUTPUTS];
+int fadeHeapSize = 0;
+
 // This array stores the last "ON" brightness (0-100) for stateful ON/OFF commands
 int outputBrightness[MAX_OUTPUTS] = {0};
 
+// Physical address of each output, rebuilt from the "i2c" config (board -1 if unmapped)
+int8_t outputBoard[MAX_OUTPUTS];
+uint8_t outputChannel[MAX_OUTPUTS];
+
+// Outputs whose level has changed since the last render
+uint8_t dirtyOutputs[MAX_OUTPUTS];
+bool outputDirty[MAX_OUTPUTS] = {false};
+int dirtyCount = 0;
+bool renderAll = true;
+
+// Rendered PWM value of each board channel, and a bitmask of channels still to be written
+uint16_t boardPwm[MAX_PCA9685_BOARDS][PCA9685_CHANNELS];
+uint16_t boardDirty[MAX_PCA9685_BOARDS] = {0};
+
+// Index of the last rendered frame, frames start on the shared clock so controllers render in step
+unsigned long lastFrame = 0;
+
+// Publish output changes on retained per-output topics (stat/output/N) instead of the shared status topic
+bool outputStatusTopics = false;
+
+// Full state snapshot interval (0 disables, snapshots are still sent on connect and on request)
+uint32_t snapshotIntervalMs = 0;
+unsigned long lastSnapshotTime = 0;
+
+// Global output ceiling applied in the render path (Q12)
+uint16_t outputCeiling = SCALE_ONE;
+
+// Grand master and group submasters (Q12), combined into a single scale per output when they change
+struct GroupMaster {
+  char name[MASTER_NAME_SIZE];              // empty if the slot is free
+  uint16_t level;
+};
+GroupMaster groupMasters[MAX_GROUP_MASTERS];
+uint16_t grandMaster = SCALE_ONE;
+uint32_t outputMasterMask[MAX_OUTPUTS] = {0};
+uint16_t outputMaster[MAX_OUTPUTS];
+
+// Output values after the masters and ceiling, before the power limit
+uint16_t renderPwm[MAX_OUTPUTS] = {0};
+
+// Power budget, the estimated load is updated incrementally as outputs are rendered
+uint32_t outputMilliwatts[MAX_OUTPUTS] = {0};
+uint32_t outputLoad[MAX_OUTPUTS] = {0};
+int32_t powerLoad = 0;
+uint32_t powerBudgetMilliwatts = 0;
+uint16_t powerScale = SCALE_ONE;
+
+// Global slew limiter, caps the sum of absolute PWM changes applied per frame (0 disables)
+uint32_t slewBudget = 0;
+uint16_t slewTarget[MAX_OUTPUTS] = {0};
+uint8_t slewPending[MAX_OUTPUTS];
+bool slewQueued[MAX_OUTPUTS] = {false};
+int slewPendingCount = 0;
+
 // This holds the device configuration in memory
-DynamicJsonDocument g_config(1024);
+TrackedJsonDocument<HEAP_TAG_CONFIG> g_config(CONFIG_DOC_SIZE);
+
+// Hash of the config on file, 0 until first checked
+uint32_t configHash = 0;
 
 // I2C sensors
 HSG_SENSORS sensors;
 
-// Forward declarations
-void setOutput(int, int, int);
-void processCommand(JsonVariant);
-void processFades();
-bool getPcaAddress(int, byte *, int *);
-void loadConfig();
-void scanI2cDevices(JsonVariant);
+// Heap allocation tracking
+HSG_HEAP heap;
+
+// Delayed and timed commands
+HSG_SCHEDULER scheduler;
+
+// Shared frame clock, synced to the leader controller
+WiFiUDP timeSyncUdp;
+HSG_TIMESYNC timeSync;
+
+// Closed-loop daylight harvesting state (PI controller driven by the BH1750)
+struct DaylightState {
+  bool enabled = false;
+  float targetLux = 0;
+  float kp = DEFAULT_DAYLIGHT_KP;
+  float ki = DEFAULT_DAYLIGHT_KI;
+  float deadbandLux = DEFAULT_DAYLIGHT_DEADBAND_LUX;
+  float maxRate = DEFAULT_DAYLIGHT_MAX_RATE;
+  float minBrightness = 0;
+  float maxBrightness = 100;
+  uint8_t outputs[MAX_OUTPUTS];
+  int outputCount = 0;
+  float integral = NAN;
+  float level = NAN;
+  uint32_t lastSequence = 0;
+  unsigned long lastStepTime = 0;
+};
+DaylightState daylight;
+
+// Thermal derating state, scales the global output ceiling as the enclosure heats up
+struct ThermalState {
+  bool enabled = false;
+  bool derating = false;
+  float startC = DEFAULT_THERMAL_START_C;
+  float endC = DEFAULT_THERMAL_END_C;
+  float minPercent = DEFAULT_THERMAL_MIN_PERCENT;
+  float rate = DEFAULT_THERMAL_RATE;
+  float hysteresisC = DEFAULT_THERMAL_HYSTERESIS_C;
+  float ceiling = 100;
+  float targetCeiling = 100;
+  uint32_t lastSequence = 0;
+};
+ThermalState thermal;
+
+// Sparse per-layer output levels, a bit per layer marks which layers hold a value
+uint16_t layerLevel[LAYER_COUNT][MAX_OUTPUTS];
+uint8_t layerPresent[MAX_OUTPUTS] = {0};
+bool layerHtp[LAYER_COUNT] = {false};
+
+// Outputs whose layers changed since the last merge, and the fade to use
+uint8_t mergeOutputs[MAX_OUTPUTS];
+bool mergeQueued[MAX_OUTPUTS] = {false};
+bool mergeForce[MAX_OUTPUTS] = {false};
+uint32_t mergeFadeMs[MAX_OUTPUTS];
+unsigned long mergeStartTime[MAX_OUTPUTS];
+int mergeCount = 0;
+
+// Layer written by the command currently being run (set by its source)
+uint8_t commandLayer = LAYER_OVERRIDE;
+
+// Timed commands take effect from their "at" time rather than when they happen to run
+bool commandTimed = false;
+unsigned long commandTime = 0;
+
+// Multi-channel fixtures, each fades a few components which a per-type kernel mixes into its channels
+struct FixtureState {
+  char name[FIXTURE_NAME_SIZE];
+  uint8_t type;
+  uint8_t space;
+  uint8_t channels[MAX_FIXTURE_CHANNELS];   // output indexes
+  uint8_t channelCount;
+  uint16_t warmMired;                       // Q4
+  uint16_t coolMired;                       // Q4
+  uint16_t startValue[FIXTURE_COMPONENTS];
+  uint16_t targetValue[FIXTURE_COMPONENTS];
+  uint16_t currentValue[FIXTURE_COMPONENTS];
+  unsigned long fadeStartTime;
+  unsigned long fadeDuration;
+  bool fading;
+  int brightness;                           // last "ON" brightness (0-100)
+};
+FixtureState fixtures[MAX_FIXTURES];
+int fixtureCount = 0;
+
+// Procedural effects, each owns a contiguous run of the effect arrays below
+struct EffectState {
+  uint8_t type;
+  uint8_t first;
+  uint8_t count;                            // 0 if the slot is free
+  uint16_t minLevel;
+  uint16_t maxLevel;
+  uint16_t width;                           // chase pulse width (Q16 of a cycle)
+  uint32_t periodMs;
+  unsigned long startTime;
+  uint8_t layer;                            // layer of the command which started it
+};
+EffectState effects[MAX_EFFECTS];
+
+// Outputs under effect control, laid out so each kernel walks a contiguous run
+uint8_t effectOutput[MAX_OUTPUTS];
+uint16_t effectPhase[MAX_OUTPUTS];          // phase offset from group order (Q16)
+uint16_t effectValue[MAX_OUTPUTS];          // candle flicker state (Q12)
+int effectOutputCount = 0;
+
+// Effect owning each output (-1 if none)
+int8_t outputEffect[MAX_OUTPUTS];
+
+// Fixture owning each output (-1 if none), fixture channels are only ever driven by their fixture
+int8_t outputFixture[MAX_OUTPUTS];
+
+// Raised cosine oscillator table (Q12) and PRNG state
+uint16_t sineTable[SINE_TABLE_SIZE + 1];
+uint32_t effectSeed = 0x2545F491;
+
+// Rules are compiled from the "rules" config into a flat table, conditions are ANDed
+struct RuleCondition {
+  uint8_t source;
+  uint8_t op;
+  uint8_t output;
+  float value;
+};
+
+struct Rule {
+  uint8_t firstCondition;
+  uint8_t conditionCount;
+  uint32_t holdMs;                // conditions must hold this long before firing
+  uint32_t repeatMs;              // re-fire while still matching (0 fires once per match)
+  bool matching = false;
+  bool fired = false;
+  unsigned long matchTime = 0;
+  unsigned long fireTime = 0;
+};
+Rule rules[MAX_RULES];
+int ruleCount = 0;
+RuleCondition ruleConditions[MAX_RULE_CONDITIONS];
+
+// Forward declarations
+void setOutput(int, int, int);
+void setOutputLevel(int, int, int);
+void startFade(int, int, int, unsigned long);
+unsigned long getCommandTime();
+unsigned long frameClock();
+void shiftFrameClock(long);
+void queueMerge(int, int);
+void releaseOutput(int, uint8_t, int);
+void releaseCommand(JsonVariant);
+void layersConfig(JsonVariant);
+void processLayers();
+int getOutputList(JsonVariant, uint8_t *, int);
+void daylightConfig(JsonVariant);
+void daylightCommand(JsonVariant);
+void processDaylight();
+void processCommand(JsonVariant);
+void runCommand(JsonVariant);
+void scheduledCommand(JsonVariant);
+void fixturesConfig(JsonVariant);
+void fixtureCommand(JsonVariant);
+void processFixtures();
+void setOutputDirect(int, uint16_t);
+void removeEffectOutput(int);
+uint8_t getEffectLayer(int);
+void effectCommand(JsonVariant);
+void processEffects();
+void rulesConfig(JsonVariant);
+void processRules();
+void masterCommand(JsonVariant);
+void buildMasterMasks();
+void processFades();
+void processFrame();
+void markOutputDirty(int);
+void buildOutputMap();
+void renderOutputs();
+void flushBoards();
+void thermalConfig(JsonVariant);
+void publishThermalEvent(float);
+void powerConfig(JsonVariant);
+void slewConfig(JsonVariant);
+void processThermal();
+bool getPcaAddress(int, byte *, int *);
+void saveConfig();
+void scanI2cDevices(JsonVariant);
+
+/*
+ * Get the physical address (PCA board and channel) for a logical output
+ */
+bool getPcaAddress(int output, byte * addr, int * channel)
+{
+  JsonObject i2c = g_config["i2c"]["pca9685"];
+  if (i2c)
+  {
+    for (JsonPair kv : i2c)
+    {
+      JsonArray mappings = kv.value().as<JsonArray>();
+      for (int i = 0; i < mappings.size(); i++)
+      {
+        if (mappings[i].as<int>() == output)
+        {
+          *addr = (byte)strtol(kv.key().c_str(), NULL, 0);
+          *channel = i;
+          return true;
+        }
+      }
+    }
+  }
+  return false;
+}
+
+/*
+ * Resolve every logical output to its board index and channel, so the
+ * render path never has to search the config
+ */
+void buildOutputMap()
+{
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    outputBoard[i] = -1;
+
+    byte addr;
+    int channel;
+    if (getPcaAddress(i + 1, &addr, &channel) && channel < PCA9685_CHANNELS)
+    {
+      for (int j = 0; j < pca_count; j++)
+      {
+        if (pca_addr[j] == addr)
+        {
+          outputBoard[i] = j;
+          outputChannel[i] = channel;
+          break;
+        }
+      }
+    }
+  }
+
+  // Mapping may have moved outputs between channels so push everything again
+  for (int i = 0; i < slewPendingCount; i++)
+  {
+    slewQueued[slewPending[i]] = false;
+  }
+  slewPendingCount = 0;
+  renderAll = true;
+}
+
+/*
+ * Queue an output to be rendered on the next frame
+ */
+void markOutputDirty(int index)
+{
+  if (outputDirty[index]) return;
+
+  outputDirty[index] = true;
+  dirtyOutputs[dirtyCount++] = index;
+}
+
+/*
+ * Apply the output's master scale and the global ceiling to its logical
+ * level, keeping the power estimate up to date with the change in its load
+ */
+void renderOutput(int index)
+{
+  uint32_t mastered = ((uint32_t)outputs[index].currentPwmValue * outputMaster[index]) >> 12;
+  uint16_t pwmValue = (mastered * outputCeiling) >> 12;
+  renderPwm[index] = pwmValue;
+
+  // Only outputs driving a board channel draw power, 64-bit as wattages can exceed a kW
+  uint32_t load = (outputBoard[index] < 0) ? 0 : ((uint64_t)outputMilliwatts[index] * pwmValue) / 4095;
+  powerLoad += (int32_t)load - (int32_t)outputLoad[index];
+  outputLoad[index] = load;
+}
+
+/*
+ * Set the physical PWM value of an output's board channel
+ */
+void writeChannel(int index, uint16_t pwmValue)
+{
+  int board = outputBoard[index];
+  uint8_t channel = outputChannel[index];
+  if (boardPwm[board][channel] != pwmValue)
+  {
+    boardPwm[board][channel] = pwmValue;
+    boardDirty[board] |= (1 << channel);
+  }
+}
+
+/*
+ * Scale an output's rendered value by the power limit into its board
+ * channel, or queue it for the slew limiter if one is configured
+ */
+void writeOutput(int index)
+{
+  if (outputBoard[index] < 0) return;
+
+  uint16_t pwmValue = ((uint32_t)renderPwm[index] * powerScale) >> 12;
+
+  if (slewBudget == 0)
+  {
+    writeChannel(index, pwmValue);
+    return;
+  }
+
+  slewTarget[index] = pwmValue;
+  if (!slewQueued[index] && boardPwm[outputBoard[index]][outputChannel[index]] != pwmValue)
+  {
+    slewQueued[index] = true;
+    slewPending[slewPendingCount++] = index;
+  }
+}
+
+/*
+ * Move queued outputs towards their targets without exceeding the
+ * per-frame budget for the sum of all level changes. When over budget
+ * each output gets a share proportional to its remaining change, so all
+ * of them arrive together and none is starved
+ */
+void processSlew()
+{
+  if (slewPendingCount == 0) return;
+
+  uint32_t totalChange = 0;
+  for (int i = 0; i < slewPendingCount; i++)
+  {
+    int index = slewPending[i];
+    totalChange += abs((int)slewTarget[index] - (int)boardPwm[outputBoard[index]][outputChannel[index]]);
+  }
+
+  int remaining = 0;
+  for (int i = 0; i < slewPendingCount; i++)
+  {
+    int index = slewPending[i];
+    int current = boardPwm[outputBoard[index]][outputChannel[index]];
+    int change = (int)slewTarget[index] - current;
+    uint32_t distance = abs(change);
+
+    uint32_t step = distance;
+    if (totalChange > slewBudget)
+    {
+      step = max((uint32_t)(((uint64_t)distance * slewBudget) / totalChange), (uint32_t)1);
+    }
+
+    if (step >= distance)
+    {
+      writeChannel(index, slewTarget[index]);
+      slewQueued[index] = false;
+    }
+    else
+    {
+      writeChannel(index, current + (change > 0 ? (int)step : -(int)step));
+      slewPending[remaining++] = index;
+    }
+  }
+  slewPendingCount = remaining;
+}
+
+/*
+ * Recalculate the power limit from the estimated load, returns true if it changed
+ */
+bool updatePowerScale()
+{
+  uint16_t scale = SCALE_ONE;
+  if (powerBudgetMilliwatts > 0 && powerLoad > (int32_t)powerBudgetMilliwatts)
+  {
+    scale = ((uint64_t)powerBudgetMilliwatts * SCALE_ONE) / powerLoad;
+  }
+
+  if (scale == powerScale) return false;
+
+  // Let consumers know when we start or stop limiting
+  if ((scale < SCALE_ONE) != (powerScale < SCALE_ONE))
+  {
+    TrackedJsonDocument<HEAP_TAG_STATUS> json(256);
+    json["event"] = "power";
+    json["state"] = (scale < SCALE_ONE) ? "limiting" : "normal";
+    json["loadWatts"] = powerLoad / 1000;
+    json["budgetWatts"] = powerBudgetMilliwatts / 1000;
+    hsg.publishStatus(json.as<JsonVariant>());
+  }
+
+  powerScale = scale;
+  return true;
+}
+
+/*
+ * Render all changed outputs (or everything after a global multiplier change)
+ */
+void renderOutputs()
+{
+  bool writeAll = renderAll;
+
+  if (renderAll)
+  {
+    // Rebuild the power estimate from scratch
+    powerLoad = 0;
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+    {
+      outputLoad[i] = 0;
+      renderOutput(i);
+    }
+    renderAll = false;
+  }
+  else
+  {
+    for (int i = 0; i < dirtyCount; i++)
+    {
+      renderOutput(dirtyOutputs[i]);
+    }
+  }
+
+  // A change in the power limit affects every output, otherwise only the dirty ones
+  if (updatePowerScale() || writeAll)
+  {
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+    {
+      writeOutput(i);
+    }
+  }
+  else
+  {
+    for (int i = 0; i < dirtyCount; i++)
+    {
+      writeOutput(dirtyOutputs[i]);
+    }
+  }
+
+  for (int i = 0; i < dirtyCount; i++)
+  {
+    outputDirty[dirtyOutputs[i]] = false;
+  }
+  dirtyCount = 0;
+
+  // Spread large steps over as many frames as the slew budget needs
+  processSlew();
+}
+
+/*
+ * Write changed channels to each board in a single auto-increment I2C
+ * transaction, so all channels of a board update together
+ */
+void flushBoards()
+{
+  for (int board = 0; board < pca_count; board++)
+  {
+    uint16_t dirty = boardDirty[board];
+    if (!dirty) continue;
+
+    // Write the span from the first to the last dirty channel (MODE1 AI is set by setPWMFreq)
+    int first = __builtin_ctz(dirty);
+    int last = 15 - __builtin_clz((uint32_t)dirty << 16);
+
+    Wire.beginTransmission(pca_addr[board]);
+    Wire.write(PCA9685_LED0_REGISTER + (4 * first));
+    for (int channel = first; channel <= last; channel++)
+    {
+      uint16_t pwmValue = boardPwm[board][channel];
+      Wire.write(0);
+      Wire.write(0);
+      Wire.write(pwmValue & 0xFF);
+      Wire.write(pwmValue >> 8);
+    }
+    Wire.endTransmission();
+
+    boardDirty[board] = 0;
+  }
+}
+
+/*
+ * Deadline ordering for the fade heap (wrap safe)
+ */
+bool fadeDueBefore(int a, int b)
+{
+  return (long)(outputs[fadeHeap[a]].nextChangeTime - outputs[fadeHeap[b]].nextChangeTime) < 0;
+}
+
+void fadeHeapSwap(int a, int b)
+{
+  uint8_t index = fadeHeap[a];
+  fadeHeap[a] = fadeHeap[b];
+  fadeHeap[b] = index;
+
+  fadeHeapPosition[fadeHeap[a]] = a;
+  fadeHeapPosition[fadeHeap[b]] = b;
+}
+
+/*
+ * Restore the heap order around an entry whose deadline has changed
+ */
+void fadeHeapSift(int position)
+{
+  while (position > 0 && fadeDueBefore(position, (position - 1) / 2))
+  {
+    fadeHeapSwap(position, (position - 1) / 2);
+    position = (position - 1) / 2;
+  }
+
+  while (true)
+  {
+    int child = (2 * position) + 1;
+    if (child >= fadeHeapSize) break;
+    if (child + 1 < fadeHeapSize && fadeDueBefore(child + 1, child)) child++;
+    if (!fadeDueBefore(child, position)) break;
+
+    fadeHeapSwap(position, child);
+    position = child;
+  }
+}
+
+/*
+ * Add an output to the fade heap, or re-order it if already there
+ */
+void fadeHeapUpdate(int index)
+{
+  int position = fadeHeapPosition[index];
+  if (position < 0)
+  {
+    position = fadeHeapSize++;
+    fadeHeap[position] = index;
+    fadeHeapPosition[index] = position;
+  }
+  fadeHeapSift(position);
+}
+
+void fadeHeapRemove(int index)
+{
+  int position = fadeHeapPosition[index];
+  if (position < 0) return;
+
+  fadeHeapSwap(position, --fadeHeapSize);
+  fadeHeapPosition[index] = -1;
+  if (position < fadeHeapSize)
+  {
+    fadeHeapSift(position);
+  }
+}
+
+/*
+ * Linear fade value at a point in time (truncated towards the start value)
+ */
+int fadeValueAt(OutputState * output, unsigned long elapsedTime)
+{
+  if (elapsedTime >= output->fadeDuration) return output->targetPwmValue;
+
+  int delta = output->targetPwmValue - output->startPwmValue;
+  return output->startPwmValue + (int)(((int64_t)delta * elapsedTime) / (int64_t)output->fadeDuration);
+}
+
+/*
+ * Work out when a fade's value will next change, so long fades are only
+ * visited when the physical value actually moves
+ */
+void scheduleNextChange(OutputState * output, unsigned long elapsedTime)
+{
+  uint32_t distance = abs(output->targetPwmValue - output->startPwmValue);
+
+  unsigned long nextElapsed = output->fadeDuration;
+  if (elapsedTime < output->fadeDuration)
+  {
+    // First time at which |delta| * elapsed / duration reaches the next step
+    uint64_t steps = ((uint64_t)distance * elapsedTime) / output->fadeDuration + 1;
+    nextElapsed = min((unsigned long)((steps * output->fadeDuration + distance - 1) / distance), output->fadeDuration);
+  }
+
+  output->nextChangeTime = output->fadeStartTime + nextElapsed;
+}
+
+/*
+ * Kicks off a fade for an output index to a target PWM value (0-4095),
+ * timed from startTime so synchronised commands line up between controllers
+ */
+void startFade(int outputIndex, int pwmValue, int fadeMs, unsigned long startTime)
+{
+  // An explicit level takes the output out of any running effect
+  removeEffectOutput(outputIndex);
+
+  // Set the start and target values for the fade
+  OutputState * state = &outputs[outputIndex];
+  state->startPwmValue = state->currentPwmValue;
+  state->targetPwmValue = constrain(pwmValue, 0, 4095);
+  state->fadeStartTime = startTime;
+  state->fadeDuration = max(fadeMs, 0);
+
+  if (state->targetPwmValue == state->currentPwmValue)
+  {
+    fadeHeapRemove(outputIndex);
+    return;
+  }
+
+  scheduleNextChange(state, 0);
+  fadeHeapUpdate(outputIndex);
+}
+
+/*
+ * Kicks off a fade for a given output to a target brightness
+ */
+void setOutput(int output, int brightness, int fadeMs)
+{
+  int outputIndex = output - 1;
+  if (outputIndex < 0 || outputIndex >= MAX_OUTPUTS) return;
+
+  setOutputLevel(output, map(brightness, 0, 100, 0, 4095), fadeMs);
+
+  // Store the "ON" brightness (0-100) for stateful commands
+  if (brightness > 0)
+  {
+    outputBrightness[outputIndex] = brightness;
+  }
+}
+
+/*
+ * Set an output's level immediately, for engines that compute a new
+ * level every frame, cancelling any fade on it
+ */
+void setOutputDirect(int index, uint16_t pwmValue)
+{
+  fadeHeapRemove(index);
+
+  OutputState * output = &outputs[index];
+  output->startPwmValue = output->targetPwmValue = pwmValue;
+  if (output->currentPwmValue != pwmValue)
+  {
+    output->currentPwmValue = pwmValue;
+    markOutputDirty(index);
+  }
+}
+
+/*--------------------------- Layers ---------------------------*/
+
+/*
+ * Look up a layer by name, returns the fallback if not recognised
+ */
+uint8_t getLayer(const char * name, uint8_t fallback)
+{
+  static const char * layers[LAYER_COUNT] = { "override", "schedule", "automation", "default" };
+
+  if (name == NULL) return fallback;
+  for (uint8_t i = 0; i < LAYER_COUNT; i++)
+  {
+    if (strcmp(name, layers[i]) == 0) return i;
+  }
+  return fallback;
+}
+
+/*
+ * Queue an output to be re-merged on the next frame
+ */
+void queueMerge(int index, int fadeMs)
+{
+  mergeFadeMs[index] = max(fadeMs, 0);
+  mergeStartTime[index] = getCommandTime();
+  if (mergeQueued[index]) return;
+
+  mergeQueued[index] = true;
+  mergeOutputs[mergeCount++] = index;
+}
+
+/*
+ * Set the level (0-4095) a layer wants for an output, the active layer is
+ * chosen by the command source (or its "layer" field)
+ */
+void setOutputLevel(int output, int pwmValue, int fadeMs)
+{
+  int outputIndex = output - 1;
+  if (outputIndex < 0 || outputIndex >= MAX_OUTPUTS) return;
+
+  // Fixture channels are mixed by their fixture, not the layers
+  if (outputFixture[outputIndex] >= 0) return;
+
+  layerLevel[commandLayer][outputIndex] = constrain(pwmValue, 0, 4095);
+  layerPresent[outputIndex] |= (1 << commandLayer);
+
+  // Layers beneath a running effect wait for it to end, at its layer or above the level
+  // always takes the output out of the effect, even if unchanged
+  if (commandLayer > getEffectLayer(outputIndex)) return;
+  queueMerge(outputIndex, fadeMs);
+  mergeForce[outputIndex] = true;
+}
+
+/*
+ * Drop a layer's value for an output so the layers beneath take over
+ */
+void releaseOutput(int index, uint8_t layer, int fadeMs)
+{
+  if (index < 0 || index >= MAX_OUTPUTS) return;
+
+  // Releasing a layer beneath a running effect changes nothing yet, at its layer or above it ends the effect
+  bool endsEffect = outputEffect[index] >= 0 && layer <= getEffectLayer(index);
+  if (!(layerPresent[index] & (1 << layer)) && !endsEffect) return;
+
+  layerPresent[index] &= ~(1 << layer);
+  if (layer > getEffectLayer(index)) return;
+
+  queueMerge(index, fadeMs);
+  if (endsEffect) mergeForce[index] = true;
+}
+
+/*
+ * Merge the layers for an output, from the default layer up. An LTP layer
+ * replaces whatever is beneath it, an HTP layer only wins if it is higher
+ */
+int mergeLayers(int index)
+{
+  int level = 0;
+  for (int layer = LAYER_COUNT - 1; layer >= 0; layer--)
+  {
+    if (layerPresent[index] & (1 << layer))
+    {
+      uint16_t value = layerLevel[layer][index];
+      level = layerHtp[layer] ? max(level, (int)value) : value;
+    }
+  }
+  return level;
+}
+
+/*
+ * Re-merge only the outputs whose layers changed, called once per frame
+ */
+void processLayers()
+{
+  for (int i = 0; i < mergeCount; i++)
+  {
+    int index = mergeOutputs[i];
+    mergeQueued[index] = false;
+
+    // Effects keep their outputs unless a level or release at their layer forced the merge
+    bool force = mergeForce[index];
+    mergeForce[index] = false;
+    if (outputEffect[index] >= 0 && !force) continue;
+
+    int level = mergeLayers(index);
+    if (level != outputs[index].targetPwmValue || force)
+    {
+      startFade(index, level, mergeFadeMs[index], mergeStartTime[index]);
+    }
+  }
+  mergeCount = 0;
+}
+
+/*
+ * Handle {"release": true, "layer": "override", "outputs": [...], "groups": [...]}
+ * (or "output"/"group"), with no outputs the whole layer is released
+ */
+void releaseCommand(JsonVariant json)
+{
+  if (!json.containsKey("release")) return;
+
+  int fadeMs = json["fade"] | DEFAULT_FADE_MS;
+
+  uint8_t list[MAX_OUTPUTS];
+  int count = getOutputList(json, list, MAX_OUTPUTS);
+  if (json.containsKey("output") && count < MAX_OUTPUTS)
+  {
+    list[count++] = json["output"].as<int>();
+  }
+
+  if (count == 0 && !json.containsKey("output") && !json.containsKey("group"))
+  {
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+    {
+      releaseOutput(i, commandLayer, fadeMs);
+    }
+    return;
+  }
+
+  for (int i = 0; i < count; i++)
+  {
+    releaseOutput(list[i] - 1, commandLayer, fadeMs);
+  }
+}
+
+/*
+ * Apply the merge rule of each layer from the "layers" config object,
+ * e.g. {"layers": {"automation": "htp"}} (layers default to "ltp")
+ */
+void layersConfig(JsonVariant json)
+{
+  if (!json.containsKey("layers")) return;
+
+  for (uint8_t layer = 0; layer < LAYER_COUNT; layer++)
+  {
+    layerHtp[layer] = false;
+  }
+
+  for (JsonPair kv : json["layers"].as<JsonObject>())
+  {
+    uint8_t layer = getLayer(kv.key().c_str(), LAYER_COUNT);
+    if (layer < LAYER_COUNT)
+    {
+      layerHtp[layer] = strcmp(kv.value() | "ltp", "htp") == 0;
+    }
+  }
+
+  // Every output with a value on more than one layer may now merge differently
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    if (layerPresent[i]) queueMerge(i, DEFAULT_FADE_MS);
+  }
+}
+
+/*
+ * Publish the settled state of an output, either on the shared status topic
+ * or on its own retained topic so the broker holds the state of every output
+ */
+void publishOutputStatus(int outputIndex, int pwmValue)
+{
+  int brightness = map(pwmValue, 0, 4095, 0, 100);
+  const char * state = (pwmValue > 0) ? "ON" : "OFF";
+
+  if (outputStatusTopics)
+  {
+    char subtopic[16];
+    char payload[40];
+    snprintf(subtopic, sizeof(subtopic), "output/%d", outputIndex + 1);
+    snprintf(payload, sizeof(payload), "{\"brightness\":%d,\"state\":\"%s\"}", brightness, state);
+    hsg.publishStatus(subtopic, payload);
+    return;
+  }
+
+  TrackedJsonDocument<HEAP_TAG_STATUS> json(1024);
+  json["output"] = outputIndex + 1;
+  json["brightness"] = brightness;
+  json["state"] = state;
+  hsg.publishStatus(json.as<JsonVariant>());
+}
+
+/*
+ * Publish every output level (0-100) in one compact message on stat/snapshot,
+ * run-length encoded straight from the output state, e.g. 160 outputs with
+ * the first two at 40% and the rest off gives {"outputs":160,"levels":"40*2,0*158"}
+ */
+void publishSnapshot()
+{
+  static char payload[SNAPSHOT_PAYLOAD_SIZE];
+  int length = snprintf(payload, sizeof(payload), "{\"outputs\":%d,\"levels\":\"", MAX_OUTPUTS);
+
+  int i = 0;
+  while (i < MAX_OUTPUTS)
+  {
+    int level = map(outputs[i].currentPwmValue, 0, 4095, 0, 100);
+    int run = 1;
+    while (i + run < MAX_OUTPUTS && map(outputs[i + run].currentPwmValue, 0, 4095, 0, 100) == level) run++;
+
+    const char * separator = (i > 0) ? "," : "";
+    if (run > 1)
+    {
+      length += snprintf(payload + length, sizeof(payload) - length, "%s%d*%d", separator, level, run);
+    }
+    else
+    {
+      length += snprintf(payload + length, sizeof(payload) - length, "%s%d", separator, level);
+    }
+    i += run;
+  }
+
+  snprintf(payload + length, sizeof(payload) - length, "\"}");
+  hsg.publishStatus("snapshot", payload);
+
+  lastSnapshotTime = millis();
+}
+
+/*
+ * Publish a snapshot when the interval is up
+ */
+void processSnapshot()
+{
+  if (snapshotIntervalMs == 0) return;
+  if ((millis() - lastSnapshotTime) < snapshotIntervalMs) return;
+
+  publishSnapshot();
+}
+
+/*
+ * Advance every fade whose value is due to change, called once per frame
+ */
+void processFades()
+{
+  unsigned long now = frameClock();
+
+  while (fadeHeapSize > 0)
+  {
+    int i = fadeHeap[0];
+    OutputState * output = &outputs[i];
+    if ((long)(now - output->nextChangeTime) < 0) break;
+
+    unsigned long elapsedTime = now - output->fadeStartTime;
+    int newPwmValue = fadeValueAt(output, elapsedTime);
+
+    // Only render the output if the value has actually changed
+    if (newPwmValue != output->currentPwmValue)
+    {
+      output->currentPwmValue = newPwmValue;
+      markOutputDirty(i);
+    }
+
+    if (newPwmValue != output->targetPwmValue)
+    {
+      scheduleNextChange(output, elapsedTime);
+      fadeHeapSift(0);
+      continue;
+    }
+
+    // The fade just completed, publish the final state to MQTT
+    fadeHeapRemove(i);
+    publishOutputStatus(i, newPwmValue);
+  }
+}
+
+/*
+ * Advance fades, then render and flush the result, once per frame
+ */
+void processFrame()
+{
+  unsigned long frame = frameClock() / FRAME_MS;
+  if (frame == lastFrame) return;
+  lastFrame = frame;
+
+  processThermal();
+  processRules();
+  processLayers();
+  processFades();
+  processEffects();
+  processFixtures();
+  renderOutputs();
+  flushBoards();
+
+  // Anything published this frame goes out together
+  hsg.flushPublishes();
+}
+
+/*
+ * Process a command for a single output or a group
+ */
+void processCommand(JsonVariant json)
+{
+  if (json.containsKey("group"))
+  {
+    // Command is for a group
+    const char * groupName = json["group"];
+    int fadeMs = json.containsKey("fade") ? json["fade"].as<int>() : DEFAULT_FADE_MS;
+    
+    JsonArray outputs = g_config["groups"][groupName];
+    if (outputs)
+    {
+      for (JsonVariant output : outputs)
+      {
+        // Create a new command for each output in the group
+        TrackedJsonDocument<HEAP_TAG_COMMAND> newCmd(1024);
+        newCmd["output"] = output.as<int>();
+        if (json.containsKey("state")) newCmd["state"] = json["state"];
+        if (json.containsKey("brightness")) newCmd["brightness"] = json["brightness"];
+        newCmd["fade"] = fadeMs;
+        processCommand(newCmd.as<JsonVariant>());
+      }
+    }
+  }
+  else if (json.containsKey("output"))
+  {
+    // Command is for a single output
+    int output = json["output"];
+    int fadeMs = json.containsKey("fade") ? json["fade"].as<int>() : DEFAULT_FADE_MS;
+
+    if (json.containsKey("state"))
+    {
+      if (strcmp(json["state"], "ON") == 0)
+      {
+        // Turn ON to last known brightness
+        setOutput(output, outputBrightness[output - 1], fadeMs);
+      }
+      else if (strcmp(json["state"], "OFF") == 0)
+      {
+        // Turn OFF
+        setOutput(output, 0, fadeMs);
+      }
+    }
+    else if (json.containsKey("brightness"))
+    {
+      // Set to a specific brightness
+      setOutput(output, json["brightness"], fadeMs);
+    }
+  }
+}
+
+/*
+ * Plain payload command for an output or group ("50", "ON", "OFF" or "50,2000"
+ * on .../cmnd/output/N or .../cmnd/group/name), same semantics as processCommand
+ */
+void plainOutputCommand(int output, int brightness, int fadeMs)
+{
+  if (output < 1 || output > MAX_OUTPUTS) return;
+
+  setOutput(output, brightness == PLAIN_ON ? outputBrightness[output - 1] : brightness, fadeMs);
+}
+
+void plainCommand(int output, const char * group, int brightness, int fadeMs)
+{
+  if (fadeMs == PLAIN_DEFAULT_FADE) fadeMs = DEFAULT_FADE_MS;
+
+  if (!group)
+  {
+    plainOutputCommand(output, brightness, fadeMs);
+    return;
+  }
+
+  for (JsonVariant member : g_config["groups"][group].as<JsonArray>())
+  {
+    plainOutputCommand(member.as<int>(), brightness, fadeMs);
+  }
+}
+
+/*
+ * Collects the outputs listed in "outputs" and the members of any "groups"
+ * (or a single "group") in a JSON object into a flat list of output numbers,
+ * returns the count. Output numbers outside 1..MAX_OUTPUTS are dropped
+ */
+int getOutputList(JsonVariant json, uint8_t * list, int maxCount)
+{
+  int count = 0;
+
+  for (JsonVariant output : json["outputs"].as<JsonArray>())
+  {
+    int number = output.as<int>();
+    if (number >= 1 && number <= MAX_OUTPUTS && count < maxCount) list[count++] = number;
+  }
+
+  for (JsonVariant group : json["groups"].as<JsonArray>())
+  {
+    for (JsonVariant output : g_config["groups"][group.as<const char *>()].as<JsonArray>())
+    {
+      int number = output.as<int>();
+      if (number >= 1 && number <= MAX_OUTPUTS && count < maxCount) list[count++] = number;
+    }
+  }
+
+  for (JsonVariant output : g_config["groups"][json["group"] | ""].as<JsonArray>())
+  {
+    int number = output.as<int>();
+    if (number >= 1 && number <= MAX_OUTPUTS && count < maxCount) list[count++] = number;
+  }
+
+  return count;
+}
+
+/*--------------------------- Masters ---------------------------*/
+
+/*
+ * Recalculate the combined master scale of an output (grand master times
+ * every submaster of a group it belongs to)
+ */
+void updateOutputMaster(int index)
+{
+  uint32_t scale = grandMaster;
+  uint32_t mask = outputMasterMask[index];
+  while (mask)
+  {
+    int master = __builtin_ctz(mask);
+    mask &= mask - 1;
+    scale = (scale * groupMasters[master].level) >> 12;
+  }
+
+  if (scale != outputMaster[index])
+  {
+    outputMaster[index] = scale;
+    markOutputDirty(index);
+  }
+}
+
+/*
+ * Find the submaster slot for a group, optionally claiming a free one
+ */
+int getGroupMaster(const char * group, bool create)
+{
+  int free = -1;
+  for (int i = 0; i < MAX_GROUP_MASTERS; i++)
+  {
+    if (groupMasters[i].name[0] == '\0')
+    {
+      if (free < 0) free = i;
+    }
+    else if (strcmp(groupMasters[i].name, group) == 0)
+    {
+      return i;
+    }
+  }
+
+  if (!create || free < 0) return -1;
+
+  strncpy(groupMasters[free].name, group, MASTER_NAME_SIZE - 1);
+  groupMasters[free].name[MASTER_NAME_SIZE - 1] = '\0';
+  groupMasters[free].level = SCALE_ONE;
+  return free;
+}
+
+/*
+ * Rebuild which submasters apply to each output from the group membership
+ */
+void buildMasterMasks()
+{
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    outputMasterMask[i] = 0;
+  }
+
+  for (int master = 0; master < MAX_GROUP_MASTERS; master++)
+  {
+    if (groupMasters[master].name[0] == '\0') continue;
+
+    for (JsonVariant output : g_config["groups"][(const char *)groupMasters[master].name].as<JsonArray>())
+    {
+      int index = output.as<int>() - 1;
+      if (index >= 0 && index < MAX_OUTPUTS) outputMasterMask[index] |= (1UL << master);
+    }
+  }
+
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    updateOutputMaster(i);
+  }
+}
+
+/*
+ * Publish a master level on the status topic
+ */
+void publishMaster(const char * group, uint16_t level)
+{
+  TrackedJsonDocument<HEAP_TAG_STATUS> json(256);
+  if (group) json["group"] = group;
+  json["master"] = (level * 100 + (SCALE_ONE / 2)) / SCALE_ONE;
+  hsg.publishStatus(json.as<JsonVariant>());
+}
+
+/*
+ * Handle {"master": 50} for the grand master and {"group": "floor1", "master": 50}
+ * for a group submaster, only the outputs affected are re-rendered
+ */
+void masterCommand(JsonVariant json)
+{
+  if (!json.containsKey("master")) return;
+
+  uint16_t level = (constrain(json["master"].as<float>(), 0.0f, 100.0f) * SCALE_ONE / 100) + 0.5;
+
+  if (!json.containsKey("group"))
+  {
+    if (level == grandMaster) return;
+
+    grandMaster = level;
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+    {
+      updateOutputMaster(i);
+    }
+    publishMaster(NULL, level);
+    return;
+  }
+
+  const char * group = json["group"];
+  if (group == NULL) return;
+
+  // Slots are claimed on first use, a full submaster is the same as none
+  int master = getGroupMaster(group, level != SCALE_ONE);
+  if (master < 0)
+  {
+    if (level != SCALE_ONE) hsg.println(F("[main] no free group master slots"));
+    return;
+  }
+
+  bool added = groupMasters[master].level == SCALE_ONE && level != SCALE_ONE;
+  groupMasters[master].level = level;
+
+  for (JsonVariant output : g_config["groups"][group].as<JsonArray>())
+  {
+    int index = output.as<int>() - 1;
+    if (index < 0 || index >= MAX_OUTPUTS) continue;
+
+    if (added) outputMasterMask[index] |= (1UL << master);
+    updateOutputMaster(index);
+  }
+
+  // Back at full, free the slot
+  if (level == SCALE_ONE)
+  {
+    for (int i = 0; i < MAX_OUTPUTS; i++)
+    {
+      outputMasterMask[i] &= ~(1UL << master);
+    }
+    groupMasters[master].name[0] = '\0';
+  }
+
+  publishMaster(group, level);
+}
+
+/*--------------------------- Daylight Harvesting ---------------------------*/
+
+/*
+ * Apply daylight controller settings from the "daylight" config object
+ */
+void daylightConfig(JsonVariant json)
+{
+  if (!json.containsKey("daylight")) return;
+
+  JsonVariant config = json["daylight"];
+  daylight.targetLux = config["targetLux"] | 0.0;
+  daylight.kp = config["kp"] | DEFAULT_DAYLIGHT_KP;
+  daylight.ki = config["ki"] | DEFAULT_DAYLIGHT_KI;
+  daylight.deadbandLux = config["deadbandLux"] | (float)DEFAULT_DAYLIGHT_DEADBAND_LUX;
+  daylight.maxRate = config["maxRatePercent"] | (float)DEFAULT_DAYLIGHT_MAX_RATE;
+  daylight.minBrightness = constrain(config["minBrightness"] | 0.0f, 0.0f, 100.0f);
+  daylight.maxBrightness = constrain(config["maxBrightness"] | 100.0f, daylight.minBrightness, 100.0f);
+  daylight.outputCount = getOutputList(config, daylight.outputs, MAX_OUTPUTS);
+  daylight.enabled = (config["enabled"] | true) && daylight.outputCount > 0 && daylight.targetLux > 0;
+
+  // Re-seed the controller from the current output level on the next sample
+  daylight.level = NAN;
+}
+
+/*
+ * Handle {"daylight": {"enabled": true, "targetLux": 400}} commands
+ */
+void daylightCommand(JsonVariant json)
+{
+  if (!json.containsKey("daylight")) return;
+
+  JsonVariant command = json["daylight"];
+  if (command.containsKey("targetLux"))
+  {
+    daylight.targetLux = command["targetLux"].as<float>();
+  }
+
+  if (command.containsKey("enabled"))
+  {
+    daylight.enabled = command["enabled"].as<bool>() && daylight.outputCount > 0 && daylight.targetLux > 0;
+    daylight.level = NAN;
+
+    // Hand the outputs back to the layers beneath once the controller stops
+    if (!daylight.enabled)
+    {
+      for (int i = 0; i < daylight.outputCount; i++)
+      {
+        releaseOutput(daylight.outputs[i] - 1, LAYER_AUTOMATION, DEFAULT_FADE_MS);
+      }
+    }
+  }
+}
+
+/*
+ * Steps the PI controller once for each new lux sample
+ */
+void processDaylight()
+{
+  const SensorChannel * lux = sensors.getLux();
+
+  if (lux->sequence == daylight.lastSequence) return;
+  daylight.lastSequence = lux->sequence;
+
+  if (!daylight.enabled || daylight.outputCount == 0) return;
+
+  unsigned long now = millis();
+  unsigned long stepMs = min(now - daylight.lastStepTime, (unsigned long)DAYLIGHT_MAX_STEP_MS);
+  daylight.lastStepTime = now;
+
+  // Bumpless start, take over from wherever the first output currently is
+  if (isnan(daylight.level))
+  {
+    daylight.level = outputs[daylight.outputs[0] - 1].currentPwmValue * 100.0 / 4095.0;
+    daylight.integral = daylight.level;
+    return;
+  }
+
+  float dt = stepMs / 1000.0;
+
+  // Hold steady while we are inside the deadband
+  float error = daylight.targetLux - lux->last;
+  if (fabs(error) <= daylight.deadbandLux)
+  {
+    error = 0;
+  }
+
+  // Integrate, clamping to the output range so the integral can't wind up
+  daylight.integral = constrain(daylight.integral + (daylight.ki * error * dt), daylight.minBrightness, daylight.maxBrightness);
+  float demand = constrain((daylight.kp * error) + daylight.integral, daylight.minBrightness, daylight.maxBrightness);
+
+  // Rate limit the change so adjustments stay imperceptible
+  float maxStep = daylight.maxRate * dt;
+  daylight.level += constrain(demand - daylight.level, -maxStep, maxStep);
+
+  // Fade over the sample interval so the level moves continuously between samples
+  int pwmValue = (int)(daylight.level * 4095.0 / 100.0 + 0.5);
+  commandLayer = LAYER_AUTOMATION;
+  for (int i = 0; i < daylight.outputCount; i++)
+  {
+    setOutputLevel(daylight.outputs[i], pwmValue, stepMs);
+  }
+  commandLayer = LAYER_OVERRIDE;
+}
+
+/*--------------------------- Thermal Derating ---------------------------*/
+
+/*
+ * Apply derating settings from the "thermal" config object
+ */
+void thermalConfig(JsonVariant json)
+{
+  if (!json.containsKey("thermal")) return;
+
+  JsonVariant config = json["thermal"];
+  thermal.startC = config["startC"] | (float)DEFAULT_THERMAL_START_C;
+  thermal.endC = max(config["endC"] | (float)DEFAULT_THERMAL_END_C, thermal.startC + 1);
+  thermal.minPercent = constrain(config["minPercent"] | (float)DEFAULT_THERMAL_MIN_PERCENT, 0.0f, 100.0f);
+  thermal.rate = config["ratePercent"] | (float)DEFAULT_THERMAL_RATE;
+  thermal.hysteresisC = config["hysteresisC"] | (float)DEFAULT_THERMAL_HYSTERESIS_C;
+  thermal.enabled = config["enabled"] | true;
+
+  // Re-evaluate against the new curve on the next frame rather than the next sample
+  thermal.lastSequence = 0;
+
+  if (!thermal.enabled)
+  {
+    // The ceiling eases back up, report the release as a normal cool down would
+    thermal.targetCeiling = 100;
+    if (thermal.derating)
+    {
+      thermal.derating = false;
+      publishThermalEvent(sensors.getTemperature()->ema);
+    }
+  }
+}
+
+/*
+ * Publish a derating event on the status topic
+ */
+void publishThermalEvent(float temperature)
+{
+  TrackedJsonDocument<HEAP_TAG_STATUS> json(256);
+  json["event"] = "thermal";
+  json["state"] = thermal.derating ? "derating" : "normal";
+  json["temperature"] = (int)(temperature * 10) / 10.0;
+  json["ceilingPercent"] = (int)thermal.targetCeiling;
+  hsg.publishStatus(json.as<JsonVariant>());
+}
+
+/*
+ * Track the smoothed enclosure temperature and ease the output ceiling
+ * towards the derating curve, called once per frame
+ */
+void processThermal()
+{
+  const SensorChannel * temperature = sensors.getTemperature();
+
+  // Recalculate the target ceiling on each new temperature sample
+  if (thermal.enabled && temperature->sequence != thermal.lastSequence)
+  {
+    thermal.lastSequence = temperature->sequence;
+
+    float tempC = temperature->ema;
+    float fraction = constrain((tempC - thermal.startC) / (thermal.endC - thermal.startC), 0.0f, 1.0f);
+    thermal.targetCeiling = 100 - (fraction * (100 - thermal.minPercent));
+
+    // Engage as soon as we cross the start threshold, release once well below it
+    if (!thermal.derating && tempC > thermal.startC)
+    {
+      thermal.derating = true;
+      publishThermalEvent(tempC);
+    }
+    else if (thermal.derating && tempC < (thermal.startC - thermal.hysteresisC))
+    {
+      thermal.derating = false;
+      publishThermalEvent(tempC);
+    }
+  }
+
+  if (thermal.ceiling == thermal.targetCeiling) return;
+
+  // Move the ceiling smoothly so derating is never a visible step
+  float maxStep = thermal.rate * FRAME_MS / 1000.0;
+  thermal.ceiling += constrain(thermal.targetCeiling - thermal.ceiling, -maxStep, maxStep);
+
+  uint16_t ceiling = (uint16_t)(thermal.ceiling * SCALE_ONE / 100.0 + 0.5);
+  if (ceiling != outputCeiling)
+  {
+    outputCeiling = ceiling;
+    renderAll = true;
+  }
+}
+
+/*--------------------------- Power Budget ---------------------------*/
+
+/*
+ * Apply per-output wattage and the overall budget from the "power" config
+ * object, e.g. {"budgetWatts": 240, "defaultWatts": 1.5, "outputWatts": {"12": 10}}
+ */
+void powerConfig(JsonVariant json)
+{
+  if (!json.containsKey("power")) return;
+
+  JsonVariant config = json["power"];
+  powerBudgetMilliwatts = (config["budgetWatts"] | 0.0) * 1000;
+
+  uint32_t defaultMilliwatts = (config["defaultWatts"] | 0.0) * 1000;
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    outputMilliwatts[i] = defaultMilliwatts;
+  }
+
+  for (JsonPair kv : config["outputWatts"].as<JsonObject>())
+  {
+    int output = atoi(kv.key().c_str());
+    if (output >= 1 && output <= MAX_OUTPUTS)
+    {
+      outputMilliwatts[output - 1] = kv.value().as<float>() * 1000;
+    }
+  }
+
+  // Estimate has to be rebuilt with the new wattages
+  renderAll = true;
+}
+
+/*--------------------------- Slew Limiter ---------------------------*/
+
+/*
+ * Apply the global slew budget from the "slew" config object, expressed as
+ * the number of full-scale channel switches allowed per second
+ */
+void slewConfig(JsonVariant json)
+{
+  if (!json.containsKey("slew")) return;
+
+  float channelsPerSecond = json["slew"]["channelsPerSecond"] | 0.0;
+  slewBudget = (uint32_t)(channelsPerSecond * 4095 * FRAME_MS / 1000);
+
+  // Without a budget anything still queued is written straight through
+  if (slewBudget == 0)
+  {
+    for (int i = 0; i < slewPendingCount; i++)
+    {
+      slewQueued[slewPending[i]] = false;
+    }
+    slewPendingCount = 0;
+    renderAll = true;
+  }
+}
+
+/*--------------------------- Fixtures ---------------------------*/
+
+/*
+ * Convert a colour temperature in Kelvin to mireds (Q4)
+ */
+uint16_t kelvinToMired(uint32_t kelvin)
+{
+  return (16000000UL + (kelvin / 2)) / max(kelvin, (uint32_t)1000);
+}
+
+/*
+ * Fixed-point HSV to RGB (Q12, hue 0-4095 is one full turn) at full value
+ */
+void hsvToRgb(uint16_t hue, uint16_t saturation, uint16_t * rgb)
+{
+  uint32_t sector = ((uint32_t)hue * 6) >> 12;
+  uint32_t fraction = ((uint32_t)hue * 6) & 4095;
+
+  uint16_t p = 4095 - saturation;
+  uint16_t q = 4095 - ((saturation * fraction) >> 12);
+  uint16_t t = 4095 - ((saturation * (4095 - fraction)) >> 12);
+
+  switch (sector)
+  {
+    case 0:  rgb[0] = 4095; rgb[1] = t;    rgb[2] = p;    break;
+    case 1:  rgb[0] = q;    rgb[1] = 4095; rgb[2] = p;    break;
+    case 2:  rgb[0] = p;    rgb[1] = 4095; rgb[2] = t;    break;
+    case 3:  rgb[0] = p;    rgb[1] = q;    rgb[2] = 4095; break;
+    case 4:  rgb[0] = t;    rgb[1] = p;    rgb[2] = 4095; break;
+    default: rgb[0] = 4095; rgb[1] = p;    rgb[2] = q;    break;
+  }
+}
+
+/*
+ * Current colour of a fixture as RGB (Q12), whatever space it fades in
+ */
+void getFixtureRgb(FixtureState * fixture, uint16_t * rgb)
+{
+  const uint16_t * colour = &fixture->currentValue[FIXTURE_COLOUR];
+  if (fixture->space == COLOUR_SPACE_HSV)
+  {
+    hsvToRgb(colour[0], colour[1], rgb);
+  }
+  else
+  {
+    rgb[0] = colour[0];
+    rgb[1] = colour[1];
+    rgb[2] = colour[2];
+  }
+}
+
+/*
+ * Set a fixture's target colour from RGB (0-1), converting to its colour
+ * space. Only runs when a command arrives so floats are fine here
+ */
+void setFixtureColour(FixtureState * fixture, float r, float g, float b)
+{
+  uint16_t * colour = &fixture->targetValue[FIXTURE_COLOUR];
+
+  if (fixture->space == COLOUR_SPACE_HSV)
+  {
+    float high = max(r, max(g, b));
+    float low = min(r, min(g, b));
+    float chroma = high - low;
+
+    float hue = 0;
+    if (chroma > 0)
+    {
+      if (high == r)      hue = fmod((g - b) / chroma + 6, 6);
+      else if (high == g) hue = ((b - r) / chroma) + 2;
+      else                hue = ((r - g) / chroma) + 4;
+    }
+
+    // Value is carried by the fixture level, so colours are stored at full value
+    colour[0] = (uint16_t)(hue * 4096 / 6) & 4095;
+    colour[1] = (high > 0) ? (uint16_t)(chroma / high * 4095 + 0.5) : 0;
+    colour[2] = 4095;
+  }
+  else
+  {
+    colour[0] = constrain(r, 0.0f, 1.0f) * 4095 + 0.5;
+    colour[1] = constrain(g, 0.0f, 1.0f) * 4095 + 0.5;
+    colour[2] = constrain(b, 0.0f, 1.0f) * 4095 + 0.5;
+  }
+}
+
+/*
+ * Convert CIE 1931 xy chromaticity to linear RGB (sRGB primaries, D65),
+ * normalised so the largest component is 1
+ */
+void xyToRgb(float x, float y, float * rgb)
+{
+  if (y <= 0)
+  {
+    rgb[0] = rgb[1] = rgb[2] = 1;
+    return;
+  }
+
+  float X = x / y;
+  float Z = (1 - x - y) / y;
+
+  rgb[0] = max(( 3.2406f * X) - 1.5372f - (0.4986f * Z), 0.0f);
+  rgb[1] = max((-0.9689f * X) + 1.8758f + (0.0415f * Z), 0.0f);
+  rgb[2] = max(( 0.0557f * X) - 0.2040f + (1.0570f * Z), 0.0f);
+
+  float high = max(rgb[0], max(rgb[1], rgb[2]));
+  for (int i = 0; i < 3; i++)
+  {
+    rgb[i] = (high > 0) ? rgb[i] / high : 1;
+  }
+}
+
+/*
+ * Set a fixture channel directly
+ */
+void setFixtureChannel(FixtureState * fixture, int channel, uint16_t pwmValue)
+{
+  setOutputDirect(fixture->channels[channel], pwmValue);
+}
+
+/*
+ * Split a white level between a warm and cool channel by where the colour
+ * temperature sits between them in mired space
+ */
+void setFixtureWhite(FixtureState * fixture, int warmChannel, uint16_t level)
+{
+  uint32_t span = fixture->warmMired - fixture->coolMired;
+  uint32_t warmShare = ((uint32_t)(fixture->currentValue[FIXTURE_MIRED] - fixture->coolMired) * SCALE_ONE) / span;
+  uint16_t warm = ((uint32_t)level * warmShare) >> 12;
+
+  setFixtureChannel(fixture, warmChannel, warm);
+  setFixtureChannel(fixture, warmChannel + 1, level - warm);
+}
+
+/*
+ * Mix the current fixture components into its channel levels
+ */
+void renderFixture(FixtureState * fixture)
+{
+  uint32_t level = fixture->currentValue[FIXTURE_LEVEL];
+
+  if (fixture->type == FIXTURE_CCT)
+  {
+    setFixtureWhite(fixture, 0, level);
+    return;
+  }
+
+  uint16_t rgb[3];
+  getFixtureRgb(fixture, rgb);
+  for (int c = 0; c < 3; c++)
+  {
+    setFixtureChannel(fixture, c, (rgb[c] * level) >> 12);
+  }
+
+  uint16_t white = (fixture->currentValue[FIXTURE_WHITE] * level) >> 12;
+  if (fixture->type == FIXTURE_RGBW)
+  {
+    setFixtureChannel(fixture, 3, white);
+  }
+  else if (fixture->type == FIXTURE_RGBCCT)
+  {
+    setFixtureWhite(fixture, 3, white);
+  }
+}
+
+/*
+ * Derive a fixture's components from its channels' current levels, so the
+ * first fade after (re)configuration starts from what is actually showing
+ */
+void seedFixture(FixtureState * fixture)
+{
+  uint32_t values[MAX_FIXTURE_CHANNELS];
+  for (int c = 0; c < fixture->channelCount; c++)
+  {
+    values[c] = outputs[fixture->channels[c]].currentPwmValue;
+  }
+
+  uint32_t span = fixture->warmMired - fixture->coolMired;
+  fixture->currentValue[FIXTURE_MIRED] = fixture->coolMired + (span / 2);
+  fixture->currentValue[FIXTURE_WHITE] = 0;
+
+  if (fixture->type == FIXTURE_CCT)
+  {
+    uint32_t white = values[0] + values[1];
+    fixture->currentValue[FIXTURE_LEVEL] = min(white, (uint32_t)4095);
+    if (white)
+    {
+      fixture->currentValue[FIXTURE_MIRED] = fixture->coolMired + ((span * values[0]) / white);
+    }
+    return;
+  }
+
+  // The brightest channel sets the level, the rest are relative to it
+  uint32_t white = (fixture->type == FIXTURE_RGBCCT) ? values[3] + values[4] : (fixture->type == FIXTURE_RGBW) ? values[3] : 0;
+  uint32_t level = min(max(max(values[0], values[1]), max(values[2], white)), (uint32_t)4095);
+  fixture->currentValue[FIXTURE_LEVEL] = level;
+
+  if (level == 0)
+  {
+    setFixtureColour(fixture, 1, 1, 1);
+  }
+  else
+  {
+    setFixtureColour(fixture, values[0] / (float)level, values[1] / (float)level, values[2] / (float)level);
+    fixture->currentValue[FIXTURE_WHITE] = min((white * 4095) / level, (uint32_t)4095);
+    if (fixture->type == FIXTURE_RGBCCT && white)
+    {
+      fixture->currentValue[FIXTURE_MIRED] = fixture->coolMired + ((span * values[3]) / white);
+    }
+  }
+
+  // setFixtureColour works on the target, so copy it across
+  for (int c = FIXTURE_COLOUR; c < FIXTURE_COMPONENTS; c++)
+  {
+    fixture->currentValue[c] = fixture->targetValue[c];
+  }
+}
+
+/*
+ * Build the fixture table from the "fixtures" config, outputs are listed in
+ * channel order (r, g, b, then white or warm/cool), e.g.
+ * {"fixtures": {"desk": {"type": "cct", "outputs": [1, 2], "warmK": 2700, "coolK": 6500},
+ *               "cove": {"type": "rgbw", "outputs": [3, 4, 5, 6], "space": "hsv"}}}
+ */
+void fixturesConfig(JsonVariant json)
+{
+  static const char * types[] = { "cct", "rgb", "rgbw", "rgbcct" };
+  static const uint8_t typeChannels[] = { 2, 3, 4, 5 };
+
+  if (!json.containsKey("fixtures")) return;
+
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    outputFixture[i] = -1;
+  }
+
+  fixtureCount = 0;
+  for (JsonPair kv : g_config["fixtures"].as<JsonObject>())
+  {
+    if (fixtureCount >= MAX_FIXTURES) break;
+
+    JsonVariant config = kv.value();
+    FixtureState * fixture = &fixtures[fixtureCount];
+
+    const char * type = config["type"] | "";
+    int channelCount = 0;
+    for (uint8_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+    {
+      if (strcmp(type, types[i]) == 0)
+      {
+        fixture->type = i;
+        channelCount = typeChannels[i];
+      }
+    }
+
+    if (channelCount == 0)
+    {
+      hsg.print(F("[main] unknown fixture type for "));
+      hsg.println(kv.key().c_str());
+      continue;
+    }
+
+    fixture->channelCount = 0;
+    for (JsonVariant output : config["outputs"].as<JsonArray>())
+    {
+      int index = output.as<int>() - 1;
+      if (index < 0 || index >= MAX_OUTPUTS || fixture->channelCount >= channelCount) break;
+      fixture->channels[fixture->channelCount++] = index;
+    }
+
+    if (fixture->channelCount != channelCount)
+    {
+      hsg.print(F("[main] wrong number of outputs for fixture "));
+      hsg.println(kv.key().c_str());
+      continue;
+    }
+
+    strncpy(fixture->name, kv.key().c_str(), FIXTURE_NAME_SIZE - 1);
+    fixture->name[FIXTURE_NAME_SIZE - 1] = '\0';
+
+    fixture->space = (strcmp(config["space"] | "rgb", "hsv") == 0) ? COLOUR_SPACE_HSV : COLOUR_SPACE_RGB;
+
+    fixture->warmMired = kelvinToMired(config["warmK"] | DEFAULT_WARM_K);
+    fixture->coolMired = kelvinToMired(config["coolK"] | DEFAULT_COOL_K);
+    if (fixture->warmMired <= fixture->coolMired)
+    {
+      fixture->warmMired = kelvinToMired(DEFAULT_WARM_K);
+      fixture->coolMired = kelvinToMired(DEFAULT_COOL_K);
+    }
+
+    // The fixture takes its channels over from any effect and the layers
+    for (int c = 0; c < fixture->channelCount; c++)
+    {
+      int index = fixture->channels[c];
+      removeEffectOutput(index);
+      layerPresent[index] = 0;
+      outputFixture[index] = fixtureCount;
+    }
+
+    fixture->fading = false;
+    fixture->brightness = 100;
+    seedFixture(fixture);
+
+    fixtureCount++;
+  }
+}
+
+/*
+ * Find a configured fixture by name
+ */
+FixtureState * getFixture(const char * name)
+{
+  if (name == NULL) return NULL;
+
+  for (int i = 0; i < fixtureCount; i++)
+  {
+    if (strcmp(fixtures[i].name, name) == 0) return &fixtures[i];
+  }
+  return NULL;
+}
+
+/*
+ * Handle fixture commands, colour and level fade together, e.g.
+ * {"fixture": "desk", "cct": 3000, "brightness": 60, "fade": 2000}
+ * {"fixture": "cove", "rgb": [255, 120, 0]}, {"fixture": "cove", "hsv": [30, 100, 60]},
+ * {"fixture": "cove", "xy": [0.45, 0.41], "white": 20} or "state": "ON"/"OFF"
+ */
+void fixtureCommand(JsonVariant json)
+{
+  if (!json.containsKey("fixture")) return;
+
+  FixtureState * fixture = getFixture(json["fixture"]);
+  if (!fixture) return;
+
+  // Start from wherever the fixture is right now, even mid-fade
+  for (int i = 0; i < FIXTURE_COMPONENTS; i++)
+  {
+    fixture->startValue[i] = fixture->targetValue[i] = fixture->currentValue[i];
+  }
+
+  bool hasWhite = fixture->type == FIXTURE_RGBW || fixture->type == FIXTURE_RGBCCT;
+  bool hasCct = fixture->type == FIXTURE_CCT || fixture->type == FIXTURE_RGBCCT;
+  int brightness = -1;
+
+  if (hasCct && json.containsKey("cct"))
+  {
+    fixture->targetValue[FIXTURE_MIRED] = constrain(kelvinToMired(json["cct"].as<uint32_t>()), fixture->coolMired, fixture->warmMired);
+  }
+
+  if (hasWhite && json.containsKey("white"))
+  {
+    fixture->targetValue[FIXTURE_WHITE] = map(constrain(json["white"].as<int>(), 0, 100), 0, 100, 0, 4095);
+  }
+
+  if (fixture->type != FIXTURE_CCT)
+  {
+    if (json.containsKey("rgb"))
+    {
+      JsonArray rgb = json["rgb"];
+      setFixtureColour(fixture, rgb[0].as<float>() / 255, rgb[1].as<float>() / 255, rgb[2].as<float>() / 255);
+    }
+    else if (json.containsKey("hsv"))
+    {
+      // Hue and saturation set the colour, value is the brightness
+      JsonArray hsv = json["hsv"];
+      uint16_t rgb[3];
+      hsvToRgb((uint16_t)(fmod(hsv[0].as<float>(), 360) * 4096 / 360) & 4095, constrain(hsv[1].as<int>(), 0, 100) * 4095 / 100, rgb);
+      setFixtureColour(fixture, rgb[0] / 4095.0, rgb[1] / 4095.0, rgb[2] / 4095.0);
+      if (hsv.size() > 2) brightness = hsv[2].as<int>();
+    }
+    else if (json.containsKey("xy"))
+    {
+      float rgb[3];
+      xyToRgb(json["xy"][0].as<float>(), json["xy"][1].as<float>(), rgb);
+      setFixtureColour(fixture, rgb[0], rgb[1], rgb[2]);
+    }
+  }
+
+  if (json.containsKey("brightness"))
+  {
+    brightness = json["brightness"].as<int>();
+  }
+
+  if (json.containsKey("state"))
+  {
+    bool on = strcmp(json["state"] | "", "ON") == 0;
+    fixture->targetValue[FIXTURE_LEVEL] = on ? map(fixture->brightness, 0, 100, 0, 4095) : 0;
+  }
+  else if (brightness >= 0)
+  {
+    brightness = constrain(brightness, 0, 100);
+    fixture->targetValue[FIXTURE_LEVEL] = map(brightness, 0, 100, 0, 4095);
+    if (brightness > 0) fixture->brightness = brightness;
+  }
+
+  fixture->fadeStartTime = getCommandTime();
+  fixture->fadeDuration = json["fade"] | DEFAULT_FADE_MS;
+  fixture->fading = true;
+}
+
+/*
+ * Publish a fixture's final state on the status topic
+ */
+void publishFixtureState(FixtureState * fixture)
+{
+  TrackedJsonDocument<HEAP_TAG_STATUS> json(256);
+  json["fixture"] = fixture->name;
+
+  if (fixture->type != FIXTURE_CCT)
+  {
+    uint16_t rgb[3];
+    getFixtureRgb(fixture, rgb);
+    JsonArray colour = json["rgb"].to<JsonArray>();
+    for (int c = 0; c < 3; c++)
+    {
+      colour.add(rgb[c] >> 4);
+    }
+  }
+
+  if (fixture->type == FIXTURE_RGBW || fixture->type == FIXTURE_RGBCCT)
+  {
+    json["white"] = map(fixture->currentValue[FIXTURE_WHITE], 0, 4095, 0, 100);
+  }
+
+  if (fixture->type == FIXTURE_CCT || fixture->type == FIXTURE_RGBCCT)
+  {
+    json["cct"] = 16000000UL / fixture->currentValue[FIXTURE_MIRED];
+  }
+
+  json["brightness"] = map(fixture->currentValue[FIXTURE_LEVEL], 0, 4095, 0, 100);
+  json["state"] = (fixture->currentValue[FIXTURE_LEVEL] > 0) ? "ON" : "OFF";
+  hsg.publishStatus(json.as<JsonVariant>());
+}
+
+/*
+ * Advance every fading fixture with a single progress fraction, so all of
+ * its components (and so its channels) move together each frame
+ */
+void processFixtures()
+{
+  unsigned long now = frameClock();
+
+  for (int i = 0; i < fixtureCount; i++)
+  {
+    FixtureState * fixture = &fixtures[i];
+    if (!fixture->fading) continue;
+
+    // Timed fades may not have started yet on the shared clock
+    if ((long)(now - fixture->fadeStartTime) < 0) continue;
+
+    unsigned long elapsedTime = now - fixture->fadeStartTime;
+    uint32_t progress = FIXTURE_PROGRESS_ONE;
+    if (elapsedTime < fixture->fadeDuration)
+    {
+      progress = ((uint64_t)elapsedTime << 16) / fixture->fadeDuration;
+    }
+
+    for (int c = 0; c < FIXTURE_COMPONENTS; c++)
+    {
+      int32_t delta = (int32_t)fixture->targetValue[c] - (int32_t)fixture->startValue[c];
+
+      // Hue goes the short way round the colour wheel
+      bool hue = (c == FIXTURE_COLOUR && fixture->space == COLOUR_SPACE_HSV);
+      if (hue)
+      {
+        if (delta > 2048) delta -= 4096;
+        else if (delta < -2048) delta += 4096;
+      }
+
+      int32_t value = fixture->startValue[c] + (int32_t)(((int64_t)delta * progress) >> 16);
+      fixture->currentValue[c] = hue ? (value & 4095) : value;
+    }
+
+    renderFixture(fixture);
+
+    if (progress == FIXTURE_PROGRESS_ONE)
+    {
+      fixture->fading = false;
+      publishFixtureState(fixture);
+    }
+  }
+}
+
+/*--------------------------- Effects ---------------------------*/
+
+/*
+ * Fill the oscillator table with one cycle of a raised cosine (Q12), so
+ * phase 0 sits at the bottom of the cycle
+ */
+void buildSineTable()
+{
+  for (int i = 0; i <= SINE_TABLE_SIZE; i++)
+  {
+    sineTable[i] = (uint16_t)((1 - cos(2 * PI * i / SINE_TABLE_SIZE)) * 4095 / 2 + 0.5);
+  }
+}
+
+/*
+ * Raised cosine of a Q16 phase (Q12), interpolated between table entries
+ */
+uint16_t sineAt(uint16_t phase)
+{
+  uint16_t index = phase >> 8;
+  int32_t fraction = phase & 0xFF;
+  return sineTable[index] + (((sineTable[index + 1] - sineTable[index]) * fraction) >> 8);
+}
+
+/*
+ * Xorshift PRNG, plenty for flicker and cheap enough to call per channel per frame
+ */
+uint32_t effectRandom()
+{
+  effectSeed ^= effectSeed << 13;
+  effectSeed ^= effectSeed >> 17;
+  effectSeed ^= effectSeed << 5;
+  return effectSeed;
+}
+
+/*
+ * Take an output out of whichever effect owns it, closing the gap so each
+ * effect's outputs stay contiguous
+ */
+void removeEffectOutput(int index)
+{
+  int effect = outputEffect[index];
+  if (effect < 0) return;
+
+  int position = effects[effect].first;
+  while (effectOutput[position] != index) position++;
+
+  int tail = effectOutputCount - position - 1;
+  memmove(&effectOutput[position], &effectOutput[position + 1], tail * sizeof(effectOutput[0]));
+  memmove(&effectPhase[position], &effectPhase[position + 1], tail * sizeof(effectPhase[0]));
+  memmove(&effectValue[position], &effectValue[position + 1], tail * sizeof(effectValue[0]));
+  effectOutputCount--;
+
+  effects[effect].count--;
+  for (int i = 0; i < MAX_EFFECTS; i++)
+  {
+    if (effects[i].count > 0 && effects[i].first > position) effects[i].first--;
+  }
+
+  outputEffect[index] = -1;
+}
+
+/*
+ * Layer an output's effect runs at, LAYER_COUNT (beneath every layer) if it isn't in one
+ */
+uint8_t getEffectLayer(int index)
+{
+  return (outputEffect[index] >= 0) ? effects[outputEffect[index]].layer : LAYER_COUNT;
+}
+
+/*
+ * Handle effect commands for a list of outputs and/or groups, e.g.
+ * {"effect": "wave", "groups": ["cove"], "period": 6000, "min": 10, "max": 80, "spread": 1}
+ * {"effect": "stop", "groups": ["cove"]}, outputs fade back to their merged layer level
+ * (a single "group" works too, which is what group topic commands carry)
+ */
+void effectCommand(JsonVariant json)
+{
+  static const char * types[] = { "breathe", "candle", "chase", "wave" };
+
+  if (!json.containsKey("effect")) return;
+
+  uint8_t list[MAX_OUTPUTS];
+  int count = getOutputList(json, list, MAX_OUTPUTS);
+  int fadeMs = json["fade"] | DEFAULT_FADE_MS;
+
+  // Release the outputs from any effect they are already in (unless it runs on a higher layer),
+  // outputs which join the new effect below are left alone by the merge
+  for (int i = 0; i < count; i++)
+  {
+    int index = list[i] - 1;
+    if (index < 0 || index >= MAX_OUTPUTS || outputEffect[index] < 0) continue;
+    if (commandLayer > getEffectLayer(index)) continue;
+
+    removeEffectOutput(index);
+    queueMerge(index, fadeMs);
+  }
+
+  const char * name = json["effect"] | "";
+  int type = -1;
+  for (uint8_t i = 0; i < sizeof(types) / sizeof(types[0]); i++)
+  {
+    if (strcmp(name, types[i]) == 0) type = i;
+  }
+  if (type < 0 || count == 0) return;
+
+  int slot = 0;
+  while (slot < MAX_EFFECTS && effects[slot].count > 0) slot++;
+  if (slot == MAX_EFFECTS)
+  {
+    hsg.println(F("[main] no free effect slots"));
+    return;
+  }
+
+  EffectState * effect = &effects[slot];
+  effect->type = type;
+  effect->periodMs = max(json["period"] | DEFAULT_EFFECT_PERIOD_MS, 1);
+  effect->minLevel = map(constrain(json["min"] | 0, 0, 100), 0, 100, 0, 4095);
+  effect->maxLevel = map(constrain(json["max"] | 100, effect->minLevel * 100 / 4095, 100), 0, 100, 0, 4095);
+  effect->startTime = getCommandTime();
+  effect->layer = commandLayer;
+  effect->first = effectOutputCount;
+  effect->count = 0;
+
+  // A wave or chase runs once across the group by default, breathing is in step
+  float spread = json["spread"] | ((type == EFFECT_WAVE || type == EFFECT_CHASE) ? 1.0f : 0.0f);
+  effect->width = constrain(json["width"] | (1.0f / count), 0.0f, 1.0f) * 65535;
+
+  // Append the outputs in group order, which sets each one's phase offset
+  for (int i = 0; i < count; i++)
+  {
+    int index = list[i] - 1;
+    if (index < 0 || index >= MAX_OUTPUTS || outputEffect[index] >= 0 || outputFixture[index] >= 0) continue;
+
+    effectOutput[effectOutputCount] = index;
+    effectPhase[effectOutputCount] = (uint16_t)(int32_t)(spread * i * 65536 / count);
+    effectValue[effectOutputCount] = 4095;
+    effectOutputCount++;
+
+    outputEffect[index] = slot;
+    effect->count++;
+  }
+}
+
+/*
+ * Run each effect's kernel over its run of outputs, called once per frame
+ */
+void processEffects()
+{
+  if (effectOutputCount == 0) return;
+
+  unsigned long now = frameClock();
+
+  for (int e = 0; e < MAX_EFFECTS; e++)
+  {
+    EffectState * effect = &effects[e];
+    if (effect->count == 0) continue;
+
+    // Hold at the start of the cycle until a timed effect is due
+    long sinceStart = max((long)(now - effect->startTime), 0L);
+    uint16_t phase = ((uint64_t)(sinceStart % effect->periodMs) << 16) / effect->periodMs;
+    uint32_t range = effect->maxLevel - effect->minLevel;
+    int end = effect->first + effect->count;
+
+    switch (effect->type)
+    {
+      case EFFECT_BREATHE:
+      case EFFECT_WAVE:
+        for (int i = effect->first; i < end; i++)
+        {
+          uint16_t level = effect->minLevel + ((range * sineAt(phase - effectPhase[i])) >> 12);
+          setOutputDirect(effectOutput[i], level);
+        }
+        break;
+
+      case EFFECT_CHASE:
+        for (int i = effect->first; i < end; i++)
+        {
+          // Full level for the pulse width, then a tail of the same width
+          uint16_t offset = phase - effectPhase[i];
+          uint32_t level = effect->minLevel;
+          if (offset < effect->width)
+          {
+            level = effect->maxLevel;
+          }
+          else if ((uint32_t)offset < 2UL * effect->width)
+          {
+            level += range - ((range * (offset - effect->width)) / effect->width);
+          }
+          setOutputDirect(effectOutput[i], level);
+        }
+        break;
+
+      case EFFECT_CANDLE:
+        for (int i = effect->first; i < end; i++)
+        {
+          // Mostly shallow flicker with the occasional deep dip, smoothed so it never strobes
+          uint32_t random = effectRandom();
+          uint16_t dip = (random & 0xFFF) >> (((random >> 12) & 3) ? 2 : 0);
+          effectValue[i] += ((int32_t)(4095 - dip) - (int32_t)effectValue[i]) >> 2;
+          setOutputDirect(effectOutput[i], effect->minLevel + ((range * effectValue[i]) >> 12));
+        }
+        break;
+    }
+  }
+}
+
+/*--------------------------- Rules and Scenes ---------------------------*/
 
 /*
- * Get the physical address (PCA board and channel) for a logical output
+ * Parse a comparison operator, returns false if not recognised
  */
-bool getPcaAddress(int output, byte * addr, int * channel)
+bool parseRuleOp(const char * op, uint8_t * result)
 {
-  JsonObject i2c = g_config["i2c"]["pca9685"];
-  if (i2c)
+  static const char * ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+
+  if (op == NULL) return false;
+  for (uint8_t i = 0; i < sizeof(ops) / sizeof(ops[0]); i++)
   {
-    for (JsonPair kv : i2c)
+    if (strcmp(op, ops[i]) == 0)
     {
-      JsonArray mappings = kv.value().as<JsonArray>();
-      for (int i = 0; i < mappings.size(); i++)
-      {
-        if (mappings[i].as<int>() == output)
-        {
-          *addr = (byte)strtol(kv.key().c_str(), NULL, 0);
-          *channel = i;
-          return true;
-        }
-      }
+      *result = i;
+      return true;
     }
   }
   return false;
 }
 
 /*
- * Kicks off a fade for a given output to a target brightness
+ * Compile a single condition, e.g. {"sensor": "lux", "op": "<", "value": 50},
+ * {"output": 3, "op": ">=", "value": 20} or {"output": 3, "state": "ON"}
  */
-void setOutput(int output, int brightness, int fadeMs)
+bool compileRuleCondition(JsonVariant json, RuleCondition * condition)
 {
-  int outputIndex = output - 1;
-  if (outputIndex < 0 || outputIndex >= MAX_OUTPUTS) return;
+  if (json.containsKey("sensor"))
+  {
+    const char * sensor = json["sensor"];
+    if (sensor == NULL) return false;
 
-  // Set the start and target values for the fade
-  outputs[outputIndex].startPwmValue = outputs[outputIndex].currentPwmValue;
-  outputs[outputIndex].targetPwmValue = map(brightness, 0, 100, 0, 4095);
-  outputs[outputIndex].fadeStartTime = millis();
-  outputs[outputIndex].fadeDuration = fadeMs;
+    if (strcmp(sensor, "temperature") == 0) condition->source = RULE_SOURCE_TEMPERATURE;
+    else if (strcmp(sensor, "humidity") == 0) condition->source = RULE_SOURCE_HUMIDITY;
+    else if (strcmp(sensor, "lux") == 0) condition->source = RULE_SOURCE_LUX;
+    else return false;
 
-  // Store the "ON" brightness (0-100) for stateful commands
-  if (brightness > 0)
+    condition->value = json["value"] | 0.0f;
+    return parseRuleOp(json["op"], &condition->op);
+  }
+
+  if (json.containsKey("output"))
   {
-    outputBrightness[outputIndex] = brightness;
+    int output = json["output"];
+    if (output < 1 || output > MAX_OUTPUTS) return false;
+
+    condition->source = RULE_SOURCE_OUTPUT;
+    condition->output = output - 1;
+
+    if (json.containsKey("state"))
+    {
+      // ON/OFF is shorthand for a comparison against zero
+      condition->op = (strcmp(json["state"] | "", "ON") == 0) ? RULE_OP_GT : RULE_OP_EQ;
+      condition->value = 0;
+      return true;
+    }
+
+    // Brightness thresholds are compared in PWM units so evaluation needs no scaling
+    condition->value = (json["value"] | 0.0f) * 4095 / 100;
+    return parseRuleOp(json["op"], &condition->op);
   }
+
+  return false;
 }
 
 /*
- * This function runs in the main loop to handle smooth transitions
+ * Compile the "rules" config into the rule table, actions stay in the config
+ * and are looked up by rule index when they fire, e.g.
+ * {"rules": [{"if": [{"sensor": "lux", "op": "<", "value": 50}], "for": 30000,
+ *             "then": {"group": "porch", "state": "ON"}, "else": {"group": "porch", "state": "OFF"}}]}
  */
-void processFades()
+void rulesConfig(JsonVariant json)
 {
-  for (int i = 0; i < MAX_OUTPUTS; i++)
+  if (!json.containsKey("rules")) return;
+
+  ruleCount = 0;
+  int conditionCount = 0;
+
+  for (JsonVariant config : g_config["rules"].as<JsonArray>())
   {
-    // Check if a fade is active for this output
-    if (outputs[i].currentPwmValue != outputs[i].targetPwmValue)
-    {
-      unsigned long elapsedTime = millis() - outputs[i].fadeStartTime;
+    if (ruleCount >= MAX_RULES) break;
 
-      int newPwmValue;
-      if (elapsedTime >= outputs[i].fadeDuration)
-      {
-        // Fade is complete, snap to the target value
-        newPwmValue = outputs[i].targetPwmValue;
-      }
-      else
-      {
-        // Fade is in progress, calculate the intermediate value (linear interpolation)
-        float progress = (float)elapsedTime / (float)outputs[i].fadeDuration;
-        newPwmValue = outputs[i].startPwmValue + (progress * (outputs[i].targetPwmValue - outputs[i].startPwmValue));
-      }
+    Rule * rule = &rules[ruleCount];
+    rule->firstCondition = conditionCount;
+    rule->conditionCount = 0;
+    rule->holdMs = config["for"] | 0;
+    rule->repeatMs = config["every"] | 0;
+    rule->matching = false;
+    rule->fired = false;
 
-      // Only update the physical PWM chip if the value has actually changed
-      if (newPwmValue != outputs[i].currentPwmValue)
+    // A single condition can be given without wrapping it in an array
+    JsonVariant conditions = config["if"];
+    bool valid = true;
+    if (conditions.is<JsonObject>())
+    {
+      valid = conditionCount < MAX_RULE_CONDITIONS && compileRuleCondition(conditions, &ruleConditions[conditionCount]);
+      if (valid) rule->conditionCount = 1;
+    }
+    else
+    {
+      for (JsonVariant condition : conditions.as<JsonArray>())
       {
-        outputs[i].currentPwmValue = newPwmValue;
-        
-        byte addr;
-        int channel;
-        // i + 1 is the logical output number
-        if (getPcaAddress(i + 1, &addr, &channel))
+        if (conditionCount + rule->conditionCount >= MAX_RULE_CONDITIONS ||
+            !compileRuleCondition(condition, &ruleConditions[conditionCount + rule->conditionCount]))
         {
-          // Find the correct PCA9685 board and set the PWM value
-          for (int j = 0; j < pca_count; j++)
-          {
-            if (pca_addr[j] == addr)
-            {
-              pca[j].setPWM(channel, 0, newPwmValue);
-              break;
-            }
-          }
+          valid = false;
+          break;
         }
+        rule->conditionCount++;
       }
+    }
 
-      // If the fade just completed, publish the final state to MQTT
-      if (newPwmValue == outputs[i].targetPwmValue)
-      {
-        DynamicJsonDocument json(1024);
-        json["output"] = i + 1;
-        json["brightness"] = map(newPwmValue, 0, 4095, 0, 100);
-        json["state"] = (newPwmValue > 0) ? "ON" : "OFF";
-        hsg.publishStatus(json.as<JsonVariant>());
-      }
+    // Keep the slot (and so the index into the config) but never fire an invalid rule
+    if (!valid)
+    {
+      hsg.print(F("[main] ignoring invalid rule "));
+      hsg.println(ruleCount);
+      rule->conditionCount = 0;
     }
+
+    conditionCount += rule->conditionCount;
+    ruleCount++;
   }
 }
 
 /*
- * Process a command for a single output or a group
+ * Evaluate a compiled condition against the current sensor and output state
  */
-void processCommand(JsonVariant json)
+bool evaluateRuleCondition(const RuleCondition * condition)
 {
-  if (json.containsKey("group"))
+  float value;
+  switch (condition->source)
   {
-    // Command is for a group
-    const char * groupName = json["group"];
-    int fadeMs = json.containsKey("fade") ? json["fade"].as<int>() : DEFAULT_FADE_MS;
-    
-    JsonArray outputs = g_config["groups"][groupName];
-    if (outputs)
+    case RULE_SOURCE_TEMPERATURE: value = sensors.getTemperature()->ema; break;
+    case RULE_SOURCE_HUMIDITY:    value = sensors.getHumidity()->ema; break;
+    case RULE_SOURCE_LUX:         value = sensors.getLux()->ema; break;
+    case RULE_SOURCE_OUTPUT:      value = outputs[condition->output].currentPwmValue; break;
+    default: return false;
+  }
+
+  // No reading yet, so nothing can match
+  if (isnan(value)) return false;
+
+  switch (condition->op)
+  {
+    case RULE_OP_LT: return value < condition->value;
+    case RULE_OP_LE: return value <= condition->value;
+    case RULE_OP_GT: return value > condition->value;
+    case RULE_OP_GE: return value >= condition->value;
+    case RULE_OP_EQ: return value == condition->value;
+    case RULE_OP_NE: return value != condition->value;
+  }
+  return false;
+}
+
+/*
+ * Run the "then" or "else" action of a rule, either a single command or a list
+ */
+void runRuleAction(int index, const char * key)
+{
+  JsonVariant action = g_config["rules"][index][key];
+  if (action.isNull()) return;
+
+  // Rule actions write to the automation layer
+  commandLayer = LAYER_AUTOMATION;
+  if (action.is<JsonArray>())
+  {
+    for (JsonVariant command : action.as<JsonArray>())
     {
-      for (JsonVariant output : outputs)
-      {
-        // Create a new command for each output in the group
-        DynamicJsonDocument newCmd(1024);
-        newCmd["output"] = output.as<int>();
-        if (json.containsKey("state")) newCmd["state"] = json["state"];
-        if (json.containsKey("brightness")) newCmd["brightness"] = json["brightness"];
-        newCmd["fade"] = fadeMs;
-        processCommand(newCmd.as<JsonVariant>());
-      }
+      runCommand(command);
     }
   }
-  else if (json.containsKey("output"))
+  else
   {
-    // Command is for a single output
-    int output = json["output"];
-    int fadeMs = json.containsKey("fade") ? json["fade"].as<int>() : DEFAULT_FADE_MS;
+    runCommand(action);
+  }
+  commandLayer = LAYER_OVERRIDE;
+}
 
-    if (json.containsKey("state"))
+/*
+ * Evaluate every rule, called once per frame. A rule fires "then" once its
+ * conditions have held for "for" ms (and every "every" ms after that while
+ * they still hold), and fires "else" when they stop holding after firing
+ */
+void processRules()
+{
+  unsigned long now = millis();
+
+  for (int i = 0; i < ruleCount; i++)
+  {
+    Rule * rule = &rules[i];
+    if (rule->conditionCount == 0) continue;
+
+    bool match = true;
+    for (int j = 0; j < rule->conditionCount && match; j++)
     {
-      if (strcmp(json["state"], "ON") == 0)
-      {
-        // Turn ON to last known brightness
-        setOutput(output, outputBrightness[output - 1], fadeMs);
-      }
-      else if (strcmp(json["state"], "OFF") == 0)
+      match = evaluateRuleCondition(&ruleConditions[rule->firstCondition + j]);
+    }
+
+    if (match != rule->matching)
+    {
+      rule->matching = match;
+      rule->matchTime = now;
+
+      if (!match && rule->fired)
       {
-        // Turn OFF
-        setOutput(output, 0, fadeMs);
+        rule->fired = false;
+        runRuleAction(i, "else");
       }
     }
-    else if (json.containsKey("brightness"))
+
+    if (!match) continue;
+
+    if (!rule->fired && (now - rule->matchTime) >= rule->holdMs)
     {
-      // Set to a specific brightness
-      setOutput(output, json["brightness"], fadeMs);
+      rule->fired = true;
+      rule->fireTime = now;
+      runRuleAction(i, "then");
+    }
+    else if (rule->fired && rule->repeatMs > 0 && (now - rule->fireTime) >= rule->repeatMs)
+    {
+      rule->fireTime = now;
+      runRuleAction(i, "then");
     }
   }
 }
 
+/*
+ * Run each command in a named scene from the "scenes" config, e.g.
+ * {"scenes": {"evening": [{"group": "lounge", "brightness": 40}, {"output": 7, "state": "OFF"}]}}
+ */
+void runScene(const char * name)
+{
+  JsonArray scene = g_config["scenes"][name];
+  if (!scene) return;
+
+  for (JsonVariant command : scene)
+  {
+    // Steps with "after" or "at" are queued like any other command (and run as one when due)
+    if (scheduler.defer(command)) continue;
+
+    // Scenes can't nest, so just the controller and lighting commands
+    daylightCommand(command);
+    masterCommand(command);
+    fixtureCommand(command);
+    effectCommand(command);
+    releaseCommand(command);
+    processCommand(command);
+  }
+}
+
+/*
+ * Execute a command from any source (MQTT, REST or a rule action)
+ */
+void runCommand(JsonVariant json)
+{
+  // Commands with "after" or "at" are queued and come back here when due
+  if (scheduler.defer(json)) return;
+
+  // Levels go to the source's layer unless the command names one
+  uint8_t sourceLayer = commandLayer;
+  commandLayer = getLayer(json["layer"], sourceLayer);
+
+  // Clock sync and timer cancellation
+  scheduler.cmnd(json);
+
+  // Let the sensors handle any commands
+  sensors.cmnd(json);
+
+  // Daylight controller commands
+  daylightCommand(json);
+
+  // Grand master and group submasters
+  masterCommand(json);
+
+  // Full state snapshot on request
+  if (json["snapshot"] | false)
+  {
+    publishSnapshot();
+  }
+
+  // Named scenes
+  if (json.containsKey("scene"))
+  {
+    runScene(json["scene"]);
+  }
+
+  // Fixture commands
+  fixtureCommand(json);
+
+  // Procedural effects
+  effectCommand(json);
+
+  // Hand outputs back to the layers beneath
+  releaseCommand(json);
+
+  // Process any lighting commands
+  processCommand(json);
+
+  commandLayer = sourceLayer;
+}
+
+/*
+ * Shared frame clock (ms), everything which animates over time runs off
+ * this so fades and effects stay in step across synced controllers
+ */
+unsigned long frameClock()
+{
+  return timeSync.getMillis();
+}
+
+/*
+ * Move everything timed on the frame clock by a step in it, so fades,
+ * fixtures and effects carry on from where they were rather than freezing
+ * (stepped back) or jumping to the end (stepped forward)
+ */
+void shiftFrameClock(long stepMs)
+{
+  if (stepMs == 0) return;
+
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    outputs[i].fadeStartTime += stepMs;
+    outputs[i].nextChangeTime += stepMs;
+    mergeStartTime[i] += stepMs;
+  }
+
+  for (int i = 0; i < fixtureCount; i++)
+  {
+    fixtures[i].fadeStartTime += stepMs;
+  }
+
+  for (int i = 0; i < MAX_EFFECTS; i++)
+  {
+    effects[i].startTime += stepMs;
+  }
+
+  lastFrame += stepMs / FRAME_MS;
+}
+
+/*
+ * Frame clock time the running command takes effect from
+ */
+unsigned long getCommandTime()
+{
+  return commandTimed ? commandTime : frameClock();
+}
+
+/*
+ * Scheduler callback, timed commands write to the schedule layer. Commands
+ * with an "at" time are started from that exact moment (on the frame clock),
+ * so fades and effects line up across controllers whatever the frame
+ * phase or delivery order
+ */
+void scheduledCommand(JsonVariant json)
+{
+  uint64_t dueTime = scheduler.getFiringTime();
+  if (dueTime)
+  {
+    uint64_t now = scheduler.getTime();
+    commandTimed = true;
+    commandTime = frameClock() - (unsigned long)(now > dueTime ? now - dueTime : 0);
+  }
+
+  commandLayer = LAYER_SCHEDULE;
+  runCommand(json);
+  commandLayer = LAYER_OVERRIDE;
+  commandTimed = false;
+}
+
 /*
  * MQTT command callback
  */
@@ -231,11 +2728,7 @@ void mqttCommand(JsonVariant json)
   serializeJson(json, hsg);
   hsg.println();
 
-  // Let the sensors handle any commands
-  sensors.cmnd(json);
-
-  // Process any lighting commands
-  processCommand(json);
+  runCommand(json);
 }
 
 /*
@@ -249,8 +2742,68 @@ void mqttConfig(JsonVariant json)
     g_config[kv.key()] = kv.value();
   }
 
+  // Anything which didn't fit comes back null
+  if (g_config.overflowed())
+  {
+    hsg.println(F("[main] config too large, some settings have been dropped"));
+  }
+
+  // Keep it for the next restart, reading it back drops the values the merge replaced
+  saveConfig();
+
   // Let the sensors handle any config
   sensors.conf(json);
+
+  // Heap telemetry interval
+  heap.conf(json);
+
+  // Frame clock sync with other controllers
+  timeSync.conf(json);
+
+  // Per-output status topics
+  if (json.containsKey("outputStatusTopics"))
+  {
+    outputStatusTopics = json["outputStatusTopics"].as<bool>();
+  }
+
+  // Full state snapshot interval
+  if (json.containsKey("snapshotSeconds"))
+  {
+    snapshotIntervalMs = json["snapshotSeconds"].as<uint32_t>() * 1000L;
+  }
+
+  // Daylight controller (resolves groups so must follow the merge above)
+  daylightConfig(json);
+
+  // Thermal derating
+  thermalConfig(json);
+
+  // Power budget
+  powerConfig(json);
+
+  // Slew limiter
+  slewConfig(json);
+
+  // Layer merge rules
+  layersConfig(json);
+
+  // Fixtures (seeded from the current output levels)
+  fixturesConfig(json);
+
+  // Rule engine (actions are looked up in the merged config)
+  rulesConfig(json);
+
+  // Output mapping may have changed
+  if (json.containsKey("i2c"))
+  {
+    buildOutputMap();
+  }
+
+  // Submasters follow group membership
+  if (json.containsKey("groups"))
+  {
+    buildMasterMasks();
+  }
 }
 
 /*
@@ -273,22 +2826,46 @@ void scanI2cDevices(JsonVariant json)
 
 void setup()
 {
+  // No fades or effects are running yet
+  for (int i = 0; i < MAX_OUTPUTS; i++)
+  {
+    fadeHeapPosition[i] = -1;
+    outputEffect[i] = -1;
+    outputFixture[i] = -1;
+    outputMaster[i] = SCALE_ONE;
+  }
+  buildSineTable();
+
   // Start serial and let it settle
   Serial.begin(115200);
   delay(1000);
   Serial.println(F("[main] starting up..."));
 
+  // Libraries log through the board support package, the config applied by hsg.begin may already log
+  scheduler.setLogger(&hsg);
+  timeSync.setLogger(&hsg);
+
   // Start the board support package (which starts I2C and networking)
   hsg.begin(mqttConfig, mqttCommand);
+  hsg.onPlainCommand(plainCommand);
+  hsg.onConnected(publishSnapshot);
+
+  // Restore any pending timers (the file system is mounted, and the saved config applied, by hsg.begin)
+  scheduler.begin(scheduledCommand);
 
-  // Load our config from file
-  loadConfig();
+  // Time sync stays idle until enabled by config
+  timeSync.begin(&timeSyncUdp);
 
   // Start the sensor library (scan for attached sensors)
   sensors.begin();
 
+  // Library config offered for device discovery and adoption
+  TrackedJsonDocument<HEAP_TAG_ADOPT> configSchema(512);
+  heap.setConfigSchema(configSchema.as<JsonVariant>());
+  hsg.setConfigSchema(configSchema.as<JsonVariant>());
+
   // Scan for PCA9685 boards
-  DynamicJsonDocument doc(1024);
+  TrackedJsonDocument<HEAP_TAG_CONFIG> doc(1024);
   scanI2cDevices(doc.as<JsonVariant>());
   JsonArray pcaArray = doc["i2c"]["pca9685"];
   
@@ -307,6 +2884,9 @@ void setup()
       Serial.println(i2c_addr, HEX);
     }
   }
+
+  // Resolve the output mapping now we know which boards are present
+  buildOutputMap();
 }
 
 void loop()
@@ -314,34 +2894,104 @@ void loop()
   // Let the board support package handle networking, etc.
   hsg.loop();
 
-  // Process any active fades
-  processFades();
+  // Acquire sensor readings (non-blocking)
+  sensors.loop();
+
+  // Run the daylight harvesting controller on each new lux sample
+  processDaylight();
 
-  // Publish sensor telemetry (if any)
-  DynamicJsonDocument telemetry(1024);
+  // Keep the frame clock in step with the leader controller, carrying anything in flight across a step
+  timeSync.loop();
+  shiftFrameClock(timeSync.takeStepMs());
+
+  // Run any scheduled commands which are due
+  scheduler.loop();
+
+  // Advance any active fades and update the boards
+  processFrame();
+
+  // Periodic full state snapshot (if enabled)
+  processSnapshot();
+
+  // Publish sensor telemetry (if any), the document is kept so an idle loop allocates nothing
+  static TrackedJsonDocument<HEAP_TAG_TELEMETRY> telemetry(TELEMETRY_DOC_SIZE);
+  telemetry.clear();
   sensors.tele(telemetry.as<JsonVariant>());
+  heap.tele(telemetry.as<JsonVariant>());
+  timeSync.tele(telemetry.as<JsonVariant>());
 
   if (!telemetry.isNull())
   {
+    // The MQTT counters have no interval of their own, they go out with everything else
+    hsg.getMQTT()->tele(telemetry.as<JsonVariant>());
     hsg.publishTelemetry(telemetry.as<JsonVariant>());
   }
 }
 
 /*
- * Load config from file
+ * Hash of everything printed to it, so the config can be compared with
+ * what is on file without serialising it into a buffer
+ */
+class ConfigHash : public Print
+{
+  public:
+    uint32_t hash = 2166136261UL;
+
+    size_t write(uint8_t b)
+    {
+      hash = (hash ^ b) * 16777619UL;
+      return 1;
+    }
+};
+
+/*
+ * Save the merged config to file (only if it has changed, a retained config
+ * arrives on every connect) and read it back. Rules and scenes then still
+ * run after a restart without the broker, and the re-read compacts the
+ * document without needing a second copy of it
  */
-void loadConfig()
+void saveConfig()
 {
-  // Mount file system
-  if (LittleFS.begin())
+  // Hash what is on file the first time round, so the config restored at boot isn't rewritten
+  if (configHash == 0)
   {
-    // Open config file
     File file = LittleFS.open(CONFIG_JSON_PATH, "r");
     if (file)
     {
-      // Deserialize the JSON document
-      deserializeJson(g_config, file);
+      ConfigHash saved;
+      while (file.available()) saved.write(file.read());
+      configHash = saved.hash;
       file.close();
     }
   }
+
+  ConfigHash current;
+  serializeJson(g_config, current);
+
+  if (current.hash != configHash)
+  {
+    File file = LittleFS.open(CONFIG_JSON_PATH, "w");
+    if (!file)
+    {
+      hsg.println(F("[main] failed to save config"));
+      return;
+    }
+
+    serializeJson(g_config, file);
+    file.close();
+    configHash = current.hash;
+  }
+
+  File file = LittleFS.open(CONFIG_JSON_PATH, "r");
+  if (!file) return;
+
+  g_config.clear();
+  DeserializationError error = deserializeJson(g_config, file);
+  file.close();
+
+  if (error)
+  {
+    hsg.print(F("[main] failed to reload config: "));
+    hsg.println(error.c_str());
+  }
 }